@@ -0,0 +1,458 @@
+/*H********************************************************************************
+* Ime datoteke: client.cpp
+*
+* Opis:
+*		Generator obremenitve za odmevni strežnik. Odpre podano število
+*		hkratnih povezav na vrata 1053, pošilja sporočila s ciljno hitrostjo
+*		(odprta zanka) in meri čas do vrnjenega odmeva. Na koncu izpiše
+*		p50/p99/p999 zakasnitve, število sporočil in bajtov na sekundo.
+*
+*H*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define PORT 1053
+#define HOST "127.0.0.1"
+#define MAX_EVENTS 1024
+#define RECV_BUFFER_SIZE 65536
+#define QUEUE_SIZE 4096
+#define DRAIN_NS 1000000000LL
+
+#define DEFAULT_CONN_COUNT 1
+#define DEFAULT_RATE 1000
+#define DEFAULT_DURATION 10
+#define DEFAULT_SIZE 64
+#define DEFAULT_THREAD_COUNT 1
+
+/*
+Histogram zakasnitev v nanosekundah: vrednosti pod 64 so točne,
+višje pa razdelimo na 32 podrazredov na potenco števila 2 (~3 % napake).
+*/
+#define HIST_SIZE 1920
+
+/*
+Poslano, a še ne vrnjeno sporočilo. Čas je načrtovani čas pošiljanja,
+da zakasnitev vključuje tudi čakanje, ko klient zaostaja (odprta zanka).
+*/
+struct message {
+	long long scheduled;
+	int size;
+};
+
+struct clientConn {
+	int sock;
+	long long outPending;
+	int queueHead;
+	int queueLen;
+	int recvOffset;
+	message queue[QUEUE_SIZE];
+};
+
+struct worker {
+	int index;
+	int connCount;
+	double rate;
+	long long end;
+	clientConn* conns;
+	unsigned int seed;
+	long long sent;
+	long long received;
+	long long dropped;
+	long long errors;
+	long long bytesSent;
+	long long bytesReceived;
+	long long histogram[HIST_SIZE];
+};
+
+long long nowNs();
+int histIndex(long long value);
+long long histValue(int index);
+double percentile(long long* histogram, long long count, double p);
+int connectClient();
+void* runWorker(void* arg);
+void enqueue(worker* w, clientConn* conn, long long scheduled);
+int flush(worker* w, clientConn* conn);
+int drain(worker* w, clientConn* conn, char* buff);
+
+int minSize = DEFAULT_SIZE;
+int maxSize = DEFAULT_SIZE;
+int duration = DEFAULT_DURATION;
+char* payload;
+
+// command: ./client <connections> <rate> <seconds> <size> <maxSize> <threads>
+// connections - number of concurrent connections
+// rate - target messages per second over all connections, 0 for closed loop
+//        (each connection waits for the echo before sending again)
+// seconds - duration of the measurement
+// size, maxSize - payload size is uniform in [size, maxSize], fixed if maxSize is omitted
+// threads - number of client threads the connections are split across
+int main(int argc, char **argv)
+{
+	int connCount = DEFAULT_CONN_COUNT;
+	double rate = DEFAULT_RATE;
+	int threadCount = DEFAULT_THREAD_COUNT;
+	if (argc > 1)
+		connCount = atoi(argv[1]);
+	if (argc > 2)
+		rate = atof(argv[2]);
+	if (argc > 3)
+		duration = atoi(argv[3]);
+	if (argc > 4)
+		minSize = maxSize = atoi(argv[4]);
+	if (argc > 5)
+		maxSize = atoi(argv[5]);
+	if (argc > 6)
+		threadCount = atoi(argv[6]);
+
+	if (connCount < 1 || threadCount < 1 || minSize < 1 || maxSize < minSize || rate < 0)
+	{
+		printf("Invalid arguments\n");
+		return 1;
+	}
+	if (threadCount > connCount)
+		threadCount = connCount;
+
+	rlimit limit;
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max)
+	{
+		limit.rlim_cur = limit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &limit);
+	}
+
+	payload = (char*) malloc(maxSize);
+	memset(payload, 'x', maxSize);
+
+	worker* workers = (worker*) calloc(threadCount, sizeof(worker));
+	pthread_t threads[threadCount];
+	for (int i = 0; i < threadCount; i++)
+	{
+		worker* w = &workers[i];
+		w->index = i;
+		w->connCount = (i + 1) * connCount / threadCount - i * connCount / threadCount;
+		w->rate = rate * w->connCount / connCount;
+		w->seed = (unsigned int) time(NULL) + i;
+		w->conns = (clientConn*) calloc(w->connCount, sizeof(clientConn));
+		for (int j = 0; j < w->connCount; j++)
+		{
+			w->conns[j].sock = connectClient();
+			if (w->conns[j].sock == -1)
+				return 1;
+		}
+	}
+
+	printf("Connections: %d, threads: %d, target rate: ", connCount, threadCount);
+	if (rate > 0)
+		printf("%.0f msg/s", rate);
+	else
+		printf("closed loop");
+	printf(", payload: %d-%d B, duration: %d s\n", minSize, maxSize, duration);
+
+	for (int i = 0; i < threadCount; i++)
+	{
+		int err = pthread_create(&threads[i], NULL, runWorker, &workers[i]);
+		if (err) {
+			printf("Failed to create thread: %d", err);
+			return err;
+		}
+	}
+
+	long long histogram[HIST_SIZE] = { 0 };
+	long long sent = 0, received = 0, dropped = 0, errors = 0, bytesSent = 0, bytesReceived = 0;
+	for (int i = 0; i < threadCount; i++)
+	{
+		pthread_join(threads[i], NULL);
+		worker* w = &workers[i];
+		sent += w->sent;
+		received += w->received;
+		dropped += w->dropped;
+		errors += w->errors;
+		bytesSent += w->bytesSent;
+		bytesReceived += w->bytesReceived;
+		for (int j = 0; j < HIST_SIZE; j++)
+			histogram[j] += w->histogram[j];
+	}
+
+	printf("Sent: %lld, received: %lld, dropped: %lld, errors: %lld\n", sent, received, dropped, errors);
+	printf("Throughput: %.0f msg/s, %.2f MB/s sent, %.2f MB/s received\n",
+		(double) received / duration, bytesSent / 1e6 / duration, bytesReceived / 1e6 / duration);
+	if (received > 0)
+	{
+		printf("Latency [us]: p50 %.1f, p99 %.1f, p999 %.1f, max %.1f\n",
+			percentile(histogram, received, 0.5) / 1e3, percentile(histogram, received, 0.99) / 1e3,
+			percentile(histogram, received, 0.999) / 1e3, percentile(histogram, received, 1.0) / 1e3);
+	}
+
+	return 0;
+}
+
+long long nowNs()
+{
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+int histIndex(long long value)
+{
+	if (value < 64)
+		return value < 0 ? 0 : (int) value;
+	int msb = 63 - __builtin_clzll(value);
+	int top = (int) (value >> (msb - 5));
+	return 64 + (msb - 6) * 32 + (top - 32);
+}
+
+//Vrne sredino razreda
+long long histValue(int index)
+{
+	if (index < 64)
+		return index;
+	int msb = (index - 64) / 32 + 6;
+	long long top = (index - 64) % 32 + 32;
+	return (top << (msb - 5)) + (1LL << (msb - 5)) / 2;
+}
+
+double percentile(long long* histogram, long long count, double p)
+{
+	long long target = (long long) (p * count);
+	if (target >= count)
+		target = count - 1;
+	long long seen = 0;
+	for (int i = 0; i < HIST_SIZE; i++)
+	{
+		seen += histogram[i];
+		if (seen > target)
+			return (double) histValue(i);
+	}
+	return 0;
+}
+
+int connectClient()
+{
+	int sock = socket(AF_INET, SOCK_STREAM, 0);
+	if (sock == -1)
+	{
+		printf("Error creating socket\n");
+		return -1;
+	}
+
+	sockaddr_in serverConf;
+	serverConf.sin_port = htons(PORT);
+	serverConf.sin_family = AF_INET;
+	inet_pton(AF_INET, HOST, &serverConf.sin_addr);
+
+	if (connect(sock, (sockaddr *)&serverConf, sizeof(serverConf)) == -1)
+	{
+		printf("Connect failed\n");
+		close(sock);
+		return -1;
+	}
+
+	//Majhna sporočila želimo poslati takoj, ne združena z Naglovim algoritmom
+	int enable = 1;
+	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+	fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+	return sock;
+}
+
+void* runWorker(void* arg)
+{
+	worker* w = (worker*) arg;
+	char* buff = (char*) malloc(RECV_BUFFER_SIZE);
+
+	int epollFd = epoll_create1(0);
+	for (int i = 0; i < w->connCount; i++)
+	{
+		epoll_event event;
+		event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+		event.data.ptr = &w->conns[i];
+		epoll_ctl(epollFd, EPOLL_CTL_ADD, w->conns[i].sock, &event);
+	}
+
+	long long start = nowNs();
+	long long end = start + duration * 1000000000LL;
+	w->end = end;
+	long long interval = w->rate > 0 ? (long long) (1e9 / w->rate) : 0;
+	long long nextSend = start;
+	int nextConn = 0;
+
+	//V zaprti zanki ima vsaka povezava naenkrat na poti eno sporočilo
+	if (interval == 0)
+	{
+		for (int i = 0; i < w->connCount; i++)
+			enqueue(w, &w->conns[i], start);
+	}
+
+	epoll_event events[MAX_EVENTS];
+	while (1)
+	{
+		long long now = nowNs();
+		if (now >= end + DRAIN_NS)
+			break;
+
+		//Odprta zanka: pošljemo vsa sporočila, katerih čas je že potekel
+		while (interval > 0 && nextSend <= now && nextSend < end)
+		{
+			enqueue(w, &w->conns[nextConn], nextSend);
+			nextConn = (nextConn + 1) % w->connCount;
+			nextSend += interval;
+		}
+
+		long long wait = end + DRAIN_NS - now;
+		if (interval > 0 && nextSend < end && nextSend - now < wait)
+			wait = nextSend - now;
+		timespec timeout;
+		timeout.tv_sec = wait / 1000000000LL;
+		timeout.tv_nsec = wait % 1000000000LL;
+
+		int ready = epoll_pwait2(epollFd, events, MAX_EVENTS, &timeout, NULL);
+		if (ready == -1 && errno != EINTR)
+		{
+			printf("epoll_wait failed\n");
+			break;
+		}
+
+		for (int i = 0; i < ready; i++)
+		{
+			clientConn* conn = (clientConn*) events[i].data.ptr;
+			if (conn->sock == -1)
+				continue;
+			if ((events[i].events & EPOLLERR) || flush(w, conn) == -1 || drain(w, conn, buff) == -1)
+			{
+				w->errors++;
+				close(conn->sock);
+				conn->sock = -1;
+			}
+		}
+
+		//Po koncu meritve čakamo le še na odgovore, ki so že na poti
+		if (now >= end)
+		{
+			int inFlight = 0;
+			for (int i = 0; i < w->connCount; i++)
+				inFlight += w->conns[i].sock != -1 ? w->conns[i].queueLen : 0;
+			if (inFlight == 0)
+				break;
+		}
+	}
+
+	for (int i = 0; i < w->connCount; i++)
+	{
+		if (w->conns[i].sock != -1)
+			close(w->conns[i].sock);
+	}
+	close(epollFd);
+	free(buff);
+	return nullptr;
+}
+
+void enqueue(worker* w, clientConn* conn, long long scheduled)
+{
+	if (conn->sock == -1 || conn->queueLen == QUEUE_SIZE)
+	{
+		w->dropped++;
+		return;
+	}
+
+	int size = minSize;
+	if (maxSize > minSize)
+		size += rand_r(&w->seed) % (maxSize - minSize + 1);
+
+	message* msg = &conn->queue[(conn->queueHead + conn->queueLen) % QUEUE_SIZE];
+	msg->scheduled = scheduled;
+	msg->size = size;
+	conn->queueLen++;
+	conn->outPending += size;
+	w->sent++;
+
+	if (flush(w, conn) == -1)
+	{
+		w->errors++;
+		close(conn->sock);
+		conn->sock = -1;
+	}
+}
+
+//Pošlje čim več čakajočih bajtov; vrne -1 ob napaki
+int flush(worker* w, clientConn* conn)
+{
+	while (conn->outPending > 0)
+	{
+		int len = conn->outPending < maxSize ? (int) conn->outPending : maxSize;
+		int iResult = send(conn->sock, payload, len, MSG_NOSIGNAL);
+		if (iResult == -1)
+		{
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		conn->outPending -= iResult;
+		w->bytesSent += iResult;
+	}
+	return 0;
+}
+
+/*
+Prebere vse, kar je na voljo. Odmev je tok bajtov, zato sporočila
+zaključujemo po velikosti v vrstnem redu pošiljanja.
+*/
+int drain(worker* w, clientConn* conn, char* buff)
+{
+	while (1)
+	{
+		int iResult = recv(conn->sock, buff, RECV_BUFFER_SIZE, 0);
+		if (iResult == 0)
+			return -1;
+		if (iResult == -1)
+		{
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+
+		w->bytesReceived += iResult;
+		long long now = nowNs();
+		int remaining = iResult;
+		while (remaining > 0 && conn->queueLen > 0)
+		{
+			message* msg = &conn->queue[conn->queueHead];
+			int take = msg->size - conn->recvOffset;
+			if (take > remaining)
+				take = remaining;
+			conn->recvOffset += take;
+			remaining -= take;
+
+			if (conn->recvOffset == msg->size)
+			{
+				w->histogram[histIndex(now - msg->scheduled)]++;
+				w->received++;
+				conn->recvOffset = 0;
+				conn->queueHead = (conn->queueHead + 1) % QUEUE_SIZE;
+				conn->queueLen--;
+
+				if (w->rate == 0 && now < w->end)
+				{
+					enqueue(w, conn, now);
+					if (conn->sock == -1)
+						return 0;
+				}
+			}
+		}
+	}
+}
@@ -12,8 +12,23 @@
 #include <stdio.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdint.h>
+#include <semaphore.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
 /*
 Definiramo vrata (port) na katerem bo stre�nik poslu�al
 in velikost medponilnika za sprejemanje in po�iljanje podatkov
@@ -21,54 +36,383 @@ in velikost medponilnika za sprejemanje in po�iljanje podatkov
 #define PORT 1053
 #define BUFFER_SIZE 256
 #define DEFAULT_MAX_CONN_COUNT 1;
+#define MAX_EVENTS 1024
+//acceptConnections je ustavil sprejem, ker je zmanjkalo opisnikov
+#define ACCEPT_FD_LIMIT 1
+
+/*
+Medpomnilniki povezav so iz skupnega bazena velikostnih razredov
+od BUFFER_SIZE (256 B) do 64 KB. Vsota vseh (tudi prostih v bazenu) je omejena
+s POOL_MAX_BYTES; najmanjši medpomnilnik dobi povezava vedno.
+*/
+#define POOL_MIN_SHIFT 8
+#define POOL_MAX_SHIFT 16
+#define POOL_CLASSES (POOL_MAX_SHIFT - POOL_MIN_SHIFT + 1)
+#define POOL_MAX_BYTES (64 << 20)
+#define SHRINK_AFTER 16
+
+/*
+Števci strežnika so razdeljeni na STATS_SLOTS rež, vsaka v svoji
+predpomnilniški vrstici. Vsaka nit ob zagonu dobi naslednjo režo po vrsti
+(glavna nit režo 0), bralec pa sešteje vse, zato nobena stran ne potrebuje
+ključavnice. Režo si delita šele niti, ki sta narazen za STATS_SLOTS.
+*/
+#define STATS_SLOTS 64
+#define CACHE_LINE 64
+
+//Velikost vrste sprejetih vtičev za bazen niti, mora biti potenca števila 2
+#define HANDOFF_QUEUE_SIZE 4096
+
+#define LOG_ERROR 0
+#define LOG_WARN 1
+#define LOG_INFO 2
+#define LOG_DEBUG 3
+#define LOG_QUEUE_SIZE 65536
+#define LOG_IDLE_US 1000
+
+#define MODE_THREAD 0
+#define MODE_EPOLL 1
+#define MODE_REACTOR 2
+#define MODE_URING 3
+#define MODE_SPLICE 4
+#define MODE_POOL 5
+#define MODE_FRAME 6
+
+/*
+Okvir je 4-bajtna dolžina (omrežni vrstni red) in vsebina. Okvir mora
+v celoti pasati v največji medpomnilnik povezave, odgovore na največ
+FRAME_BATCH okvirjev pa pošljemo z enim klicem sendmsg (writev, ki ne
+sproži SIGPIPE).
+*/
+#define FRAME_HEADER_SIZE 4
+#define FRAME_BATCH 64
+#define FRAME_MAX_PAYLOAD ((1 << POOL_MAX_SHIFT) - FRAME_HEADER_SIZE)
+
+#define SPLICE_PIPE_SIZE (1 << 20)
+
+#define URING_ENTRIES 4096
+#define URING_BUFFER_COUNT 1024
+#define URING_BUFFER_SIZE 4096
+#define URING_UNSUPPORTED -2
+//Največ toliko čakajočih medpomnilnikov povezave pošljemo z enim sendmsg
+#define URING_WRITE_BATCH 16
+/*
+Povezava ima v vrsti največ približno toliko medpomnilnikov; ko jih doseže,
+prekličemo njen recv in ga ponovno sprožimo, ko se vrsta izprazni do
+polovice, tako da klient, ki ne bere, ne pobere celega obroča.
+*/
+#define URING_CONN_BUFFERS 32
+
+//Vrsta operacije je zapisana v spodnjih bitih user_data
+#define URING_ACCEPT 0
+#define URING_RECV 1
+#define URING_WRITE 2
+#define URING_CANCEL 3
+#define URING_OP_MASK 3
+
+/*
+Stanje povezave v epoll načinu. Ker so vtiči neblokirajoči,
+si zapomnimo podatke, ki jih še nismo uspeli poslati nazaj.
+*/
+struct reactorArgs {
+	int index;
+	int maxConnCount;
+};
+
+/*
+Medpomnilnik povezave, ki raste, ko branje ga napolni, in se skrči po
+SHRINK_AFTER zaporednih branjih, ki zasedejo manj kot četrtino.
+*/
+struct clientBuffer {
+	char* data;
+	int shift;
+	int smallReads;
+};
+
+struct connection {
+	int sock;
+	int pending;
+	int offset;
+	int filled;
+	int frameStart;
+	int pipe[2];
+	int pipeSize;
+	clientBuffer buff;
+};
+
+/*
+Stanje povezave v io_uring načinu. Prejeti medpomnilniki čakajo v
+vrsti (seznam indeksov medpomnilnikov), da jih pošljemo po vrsti,
+refs pa šteje operacije, ki jih jedro še izvaja nad povezavo. queued je
+dolžina vrste, receiving pa pove, ali je recv povezave še aktiven.
+Ko klient zapre svojo smer (readDone), vrsto še izpraznimo in šele nato zapremo.
+*/
+struct uringConnection {
+	int sock;
+	int refs;
+	int closing;
+	int readDone;
+	int writing;
+	int queueHead;
+	int queueTail;
+	int offset;
+	int starved;
+	int queued;
+	int receiving;
+	int cancelling;
+	uringConnection* nextStarved;
+	//Jedro bere msg in iov, dokler pošiljanje ne konča
+	msghdr msg;
+	iovec iov[URING_WRITE_BATCH];
+};
+
+struct uring {
+	int fd;
+	size_t ringSize;
+	size_t sqesSize;
+	char* ringPtr;
+	unsigned sqEntries;
+	unsigned* sqHead;
+	unsigned* sqTail;
+	unsigned* sqMask;
+	unsigned* sqArray;
+	io_uring_sqe* sqes;
+	unsigned sqLocalTail;
+	unsigned* cqHead;
+	unsigned* cqTail;
+	unsigned* cqMask;
+	io_uring_cqe* cqes;
+	io_uring_buf_ring* bufRing;
+	unsigned short bufTail;
+	char* buffers;
+	int bufferLen[URING_BUFFER_COUNT];
+	int bufferNext[URING_BUFFER_COUNT];
+	int recycled;
+	uringConnection* starved;
+	int listener;
+	int maxConnCount;
+	int connCount;
+};
+
+struct statsSlot {
+	long long accepted;
+	long long rejected;
+	long long closed;
+	long long bytesIn;
+	long long bytesOut;
+} __attribute__((aligned(CACHE_LINE)));
+
+/*
+Omejena vrsta z več proizvajalci in porabniki (Vyukov): vsaka celica
+ima zaporedno številko, ki pove, ali je prosta za pisanje na položaju
+pos (sequence == pos) ali polna za branje (sequence == pos + 1).
+Semafor šteje vtiče v vrsti, da prazni delavci spijo namesto da se vrtijo.
+*/
+struct handoffCell {
+	unsigned long long sequence;
+	int sock;
+};
+
+struct handoffQueue {
+	handoffCell cells[HANDOFF_QUEUE_SIZE];
+	unsigned long long enqueuePos __attribute__((aligned(CACHE_LINE)));
+	unsigned long long dequeuePos __attribute__((aligned(CACHE_LINE)));
+	sem_t items;
+};
+
+/*
+Asinhroni dnevnik: niti v vrsto (enake zgradbe kot handoffQueue)
+vpišejo le nivo, kazalec na format in eno številsko vrednost, formatira
+in izpiše pa jih ena nit v ozadju. Ko je vrsta polna, zapis zavržemo
+in ga le preštejemo, da strežna nit nikoli ne čaka na izpis.
+*/
+struct logRecord {
+	unsigned long long sequence;
+	int level;
+	const char* format;
+	long long value;
+};
+
+struct logQueue {
+	logRecord records[LOG_QUEUE_SIZE];
+	unsigned long long enqueuePos __attribute__((aligned(CACHE_LINE)));
+	long long dropped __attribute__((aligned(CACHE_LINE)));
+};
+
+struct bufferPool {
+	pthread_mutex_t lock;
+	char* freeList[POOL_CLASSES];
+	long long allocated;
+};
 
 void* handleClient(void* arg);
+void serveClient(int clientSock);
+int runPool(int listener, int threadCount);
+void* runPoolWorker(void* arg);
+int handoffPush(handoffQueue* queue, int sock);
+int handoffPop(handoffQueue* queue);
+int parseLogLevel(const char* arg);
+void startLogger();
+void logMessage(int level, const char* format, long long value);
+void* drainLog(void*);
+void statsAdd(long long* counter, long long value);
+void statsClaimSlot();
+void printStats();
+void* reportStats(void*);
+char* poolAcquire(int shift, int force);
+void poolRelease(char* data, int shift);
+void bufferInit(clientBuffer* buff);
+void bufferAdapt(clientBuffer* buff, int received);
+int bufferResize(clientBuffer* buff, int shift, int keep, int force);
+void bufferFree(clientBuffer* buff);
+int createListener(int reusePort, int backlog);
+int parseMode(const char* arg);
+int setNonBlocking(int sock);
+void raiseFileLimit();
+int runEpoll(int listener, int maxConnCount);
+int runReactors(int maxConnCount, int reactorCount);
+void* runReactor(void* arg);
+int runUring(int listener, int maxConnCount);
+int uringSetup(uring* ring);
+int uringSupported(uring* ring);
+int uringSetupBuffers(uring* ring);
+void uringDestroy(uring* ring);
+io_uring_sqe* uringGetSqe(uring* ring);
+int uringSubmitAndWait(uring* ring);
+void uringRecycle(uring* ring, int bid);
+void uringArmAccept(uring* ring);
+void uringArmRecv(uring* ring, uringConnection* conn);
+void uringWrite(uring* ring, uringConnection* conn);
+void uringCancelRecv(uring* ring, uringConnection* conn);
+void uringResumeRecv(uring* ring, uringConnection* conn);
+void uringClose(uring* ring, uringConnection* conn);
+void uringHandleCqe(uring* ring, io_uring_cqe* cqe);
+int acceptConnections(int epollFd, int listener, int maxConnCount, int* connCount);
+int serveConnection(connection* conn);
+int serveConnectionSplice(connection* conn);
+int serveConnectionFramed(connection* conn);
+int flushFrames(connection* conn);
+int frameLength(const char* header);
+void closeConnection(connection* conn);
 
-pthread_mutex_t mutexCurrConnCount;
 int currConnCount = 0;
+statsSlot stats[STATS_SLOTS];
+__thread statsSlot* threadStats = &stats[0];
+unsigned nextStatsSlot = 1;
+int useSplice = 0;
+int useFraming = 0;
+int logLevel = LOG_INFO;
+int logSampleRate = 1;
+__thread unsigned int logSampleCounter = 0;
+logQueue* logs;
+bufferPool pool = { PTHREAD_MUTEX_INITIALIZER, { NULL }, 0 };
 
+// command: ./server <maxConnCount> <mode> <threads> <logLevel> <sample>
+// maxConnCount - number of concurrently served clients (not used by pool)
+// mode - thread (one thread per client, default), epoll (single event loop)
+//        reactor (one SO_REUSEPORT listener and event loop per thread),
+//        splice (epoll loop echoing through a per-client pipe, no user-space copy),
+//        uring (io_uring, falls back to epoll when the kernel lacks support)
+//        pool (pre-spawned workers fed by a bounded queue of accepted sockets;
+//        clients wait in the queue and are closed only when it is full)
+//        or frame (epoll loop with length-prefixed frames; replies to all
+//        complete frames of a read are sent with one sendmsg)
+// threads - number of reactor or pool threads, defaults to number of cores
+// logLevel - error, warn, info (default) or debug (per-message byte counts)
+// sample - log only every sample-th debug message, defaults to 1
+// Live counters are printed on SIGUSR1 (kill -USR1 <pid>).
 int main(int argc, char **argv)
 {
 	int maxConnCount = DEFAULT_MAX_CONN_COUNT;
+	int mode = MODE_THREAD;
+	int threadCount = (int) sysconf(_SC_NPROCESSORS_ONLN);
 	if (argc > 1) {
 		sscanf(argv[1], "%d", &maxConnCount);
 	}
+	if (argc > 2) {
+		mode = parseMode(argv[2]);
+		if (mode == -1) {
+			printf("Unknown mode: %s\n", argv[2]);
+			return 1;
+		}
+	}
+	if (argc > 3) {
+		sscanf(argv[3], "%d", &threadCount);
+	}
+	if (argc > 4) {
+		logLevel = parseLogLevel(argv[4]);
+		if (logLevel == -1) {
+			printf("Unknown log level: %s\n", argv[4]);
+			return 1;
+		}
+	}
+	if (argc > 5) {
+		sscanf(argv[5], "%d", &logSampleRate);
+	}
 
 	//Spremenjlivka za preverjane izhodnega statusa funkcij
 	int iResult;
 
 	/*
-	Ustvarimo nov vti�, ki bo poslu�al
-	in sprejemal nove kliente preko TCP/IP protokola
+	SIGUSR1 blokiramo pred ustvarjanjem niti, da ga vse podedujejo
+	blokiranega, sprejme pa ga le nit za izpis števcev.
 	*/
-	int listener = socket(AF_INET, SOCK_STREAM, 0);
-	if (listener == -1)
+	sigset_t statsSignal;
+	sigemptyset(&statsSignal);
+	sigaddset(&statsSignal, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &statsSignal, NULL);
+
+	startLogger();
+
+	pthread_t statsThread;
+	if (pthread_create(&statsThread, NULL, reportStats, NULL) == 0)
+		pthread_detach(statsThread);
+
+	//Splice in okvirji sta načina odmeva znotraj epoll zanke
+	if (mode == MODE_SPLICE)
 	{
-		printf("Error creating socket\n");
-		return 1;
+		useSplice = 1;
+		mode = MODE_EPOLL;
+	}
+	if (mode == MODE_FRAME)
+	{
+		useFraming = 1;
+		mode = MODE_EPOLL;
 	}
 
-	//Nastavimo vrata in mre�ni naslov vti�a
-	sockaddr_in listenerConf;
-	listenerConf.sin_port = htons(PORT);
-	listenerConf.sin_family = AF_INET;
-	listenerConf.sin_addr.s_addr = INADDR_ANY;
+	//Vsak reaktor ustvari svojega poslušalca, zato skupnega ne potrebujemo
+	if (mode == MODE_REACTOR)
+		return runReactors(maxConnCount, threadCount);
 
-	//Vti� pove�emo z ustreznimi vrati
-	iResult = bind(listener, (sockaddr *)&listenerConf, sizeof(listenerConf));
-	if (iResult == -1)
+	int listener = createListener(0, mode == MODE_THREAD ? 5 : SOMAXCONN);
+	if (listener == -1)
+		return 1;
+
+	if (mode == MODE_URING)
 	{
-		printf("Bind failed\n");
+		iResult = runUring(listener, maxConnCount);
+		if (iResult != URING_UNSUPPORTED)
+		{
+			close(listener);
+			return iResult;
+		}
+		printf("io_uring not supported, falling back to epoll\n");
+		mode = MODE_EPOLL;
+	}
+
+	//V epoll načinu vse povezave streže ena nit
+	if (mode == MODE_EPOLL)
+	{
+		iResult = runEpoll(listener, maxConnCount);
 		close(listener);
-		return 1;
+		return iResult;
 	}
 
-	//Za�nemo poslu�ati
-	if (listen(listener, 5) == -1)
+	if (mode == MODE_POOL)
 	{
-		printf("Listen failed\n");
+		iResult = runPool(listener, threadCount);
 		close(listener);
-		return 1;
+		return iResult;
 	}
 
 	//Definiramo nov vti� in medpomnilik
@@ -92,17 +436,21 @@ int main(int argc, char **argv)
 			return 1;
 		}
 
-		pthread_mutex_lock(&mutexCurrConnCount);
-		int currCount = currConnCount;
-		pthread_mutex_unlock(&mutexCurrConnCount);
-		
-		if (currCount >= maxConnCount) {
-			printf("Max connection count reached. Closing new socket\n");
+		/*
+		Mesto rezerviramo pred zagonom niti, tako da hkratni
+		sprejemi ne morejo preseči maxConnCount
+		*/
+		if (__atomic_add_fetch(&currConnCount, 1, __ATOMIC_RELAXED) > maxConnCount) {
+			__atomic_sub_fetch(&currConnCount, 1, __ATOMIC_RELAXED);
+			statsAdd(&threadStats->rejected, 1);
+			logMessage(LOG_WARN, "Max connection count reached. Closing new socket\n", 0);
 			close(clientSock);
 			continue;
 		}
-		
-		int err = pthread_create(&threadId, NULL, handleClient, &clientSock);
+		statsAdd(&threadStats->accepted, 1);
+
+		//Vtič podamo po vrednosti, saj se clientSock ob naslednjem sprejemu prepiše
+		int err = pthread_create(&threadId, NULL, handleClient, (void*) (intptr_t) clientSock);
 		if (err) {
 			printf("Failed to create thread: %d", err);
 			return err;
@@ -123,49 +471,1488 @@ int main(int argc, char **argv)
 
 void* handleClient(void* arg)
 {
-	pthread_mutex_lock(&mutexCurrConnCount);
-	currConnCount++;
-	pthread_mutex_unlock(&mutexCurrConnCount);
+	int clientSock = (int) (intptr_t) arg;
+	statsClaimSlot();
+	serveClient(clientSock);
+	__atomic_sub_fetch(&currConnCount, 1, __ATOMIC_RELAXED);
+
+	int ret = 0;
+	pthread_exit(&ret);
+	return nullptr;
+}
 
-	int clientSock =  *((int *) arg);
-	char buff[BUFFER_SIZE];
+//Blokirajoč odmev enega klienta, dokler se povezava ne zapre
+void serveClient(int clientSock)
+{
+	clientBuffer buff;
+	bufferInit(&buff);
 	int iResult;
 	do
 	{
 		//Sprejmi podatke
-		iResult = recv(clientSock, buff, BUFFER_SIZE, 0);
+		iResult = recv(clientSock, buff.data, 1 << buff.shift, 0);
 		if (iResult > 0)
 		{
-			printf("Bytes received: %d\n", iResult);
+			logMessage(LOG_DEBUG, "Bytes received: %lld\n", iResult);
+			statsAdd(&threadStats->bytesIn, iResult);
+			int received = iResult;
 
 			//Vrni prejete podatke po�iljatelju
-			iResult = send(clientSock, buff, iResult, 0);
+			iResult = send(clientSock, buff.data, iResult, MSG_NOSIGNAL);
 			if (iResult == -1)
 			{
-				printf("send failed!\n");
-				close(clientSock);
+				logMessage(LOG_WARN, "send failed!\n", 0);
 				break;
 			}
-			printf("Bytes sent: %d\n", iResult);
+			logMessage(LOG_DEBUG, "Bytes sent: %lld\n", iResult);
+			statsAdd(&threadStats->bytesOut, iResult);
+			bufferAdapt(&buff, received);
 		}
 		else if (iResult == 0)
-			printf("Connection closing...\n");
+			logMessage(LOG_DEBUG, "Connection closing...\n", 0);
 		else
 		{
-			printf("recv failed!\n");
-			close(clientSock);
+			logMessage(LOG_WARN, "recv failed!\n", 0);
 			break;
 		}
 
 	} while (iResult > 0);
 
 	close(clientSock);
-	
-	pthread_mutex_lock(&mutexCurrConnCount);
-	currConnCount--;
-	pthread_mutex_unlock(&mutexCurrConnCount);
+	bufferFree(&buff);
+
+	statsAdd(&threadStats->closed, 1);
+}
+
+/*
+Vnaprej ustvarjene niti jemljejo sprejete vtiče iz omejene vrste,
+zato sprejemanje ne plača ustvarjanja niti. Ko so vsi delavci zasedeni,
+klienti čakajo v vrsti; zavrnemo jih šele, ko je vrsta polna.
+*/
+int runPool(int listener, int threadCount)
+{
+	if (threadCount < 1)
+		threadCount = 1;
+
+	handoffQueue* queue = (handoffQueue*) malloc(sizeof(handoffQueue));
+	for (unsigned long long i = 0; i < HANDOFF_QUEUE_SIZE; i++)
+		queue->cells[i].sequence = i;
+	queue->enqueuePos = 0;
+	queue->dequeuePos = 0;
+	sem_init(&queue->items, 0, 0);
+
+	pthread_t threadId;
+	for (int i = 0; i < threadCount; i++)
+	{
+		int err = pthread_create(&threadId, NULL, runPoolWorker, queue);
+		if (err) {
+			printf("Failed to create thread: %d", err);
+			return err;
+		}
+		pthread_detach(threadId);
+	}
+
+	while (1)
+	{
+		int clientSock = accept(listener, NULL, NULL);
+		if (clientSock == -1)
+		{
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			printf("Accept failed\n");
+			return 1;
+		}
+
+		if (handoffPush(queue, clientSock) == -1)
+		{
+			statsAdd(&threadStats->rejected, 1);
+			logMessage(LOG_WARN, "Connection queue is full. Closing new socket\n", 0);
+			close(clientSock);
+			continue;
+		}
+		statsAdd(&threadStats->accepted, 1);
+	}
+}
+
+void* runPoolWorker(void* arg)
+{
+	handoffQueue* queue = (handoffQueue*) arg;
+	statsClaimSlot();
+
+	while (1)
+	{
+		if (sem_wait(&queue->items) == -1)
+			continue;
+
+		int clientSock = handoffPop(queue);
+		serveClient(clientSock);
+	}
 
-	int ret = 0;
-	pthread_exit(&ret);
 	return nullptr;
-}
\ No newline at end of file
+}
+
+int handoffPush(handoffQueue* queue, int sock)
+{
+	unsigned long long pos = __atomic_load_n(&queue->enqueuePos, __ATOMIC_RELAXED);
+	while (1)
+	{
+		handoffCell* cell = &queue->cells[pos & (HANDOFF_QUEUE_SIZE - 1)];
+		long long diff = (long long) (__atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE) - pos);
+		if (diff == 0)
+		{
+			if (__atomic_compare_exchange_n(&queue->enqueuePos, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			{
+				cell->sock = sock;
+				__atomic_store_n(&cell->sequence, pos + 1, __ATOMIC_RELEASE);
+				sem_post(&queue->items);
+				return 0;
+			}
+		}
+		else if (diff < 0)
+			return -1;
+		else
+			pos = __atomic_load_n(&queue->enqueuePos, __ATOMIC_RELAXED);
+	}
+}
+
+/*
+Klicati po uspešnem sem_wait, zato element v vrsti zagotovo je; celica
+je lahko le še sredi pisanja, takrat počakamo.
+*/
+int handoffPop(handoffQueue* queue)
+{
+	unsigned long long pos = __atomic_load_n(&queue->dequeuePos, __ATOMIC_RELAXED);
+	while (1)
+	{
+		handoffCell* cell = &queue->cells[pos & (HANDOFF_QUEUE_SIZE - 1)];
+		long long diff = (long long) (__atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE) - (pos + 1));
+		if (diff == 0)
+		{
+			if (__atomic_compare_exchange_n(&queue->dequeuePos, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			{
+				int sock = cell->sock;
+				__atomic_store_n(&cell->sequence, pos + HANDOFF_QUEUE_SIZE, __ATOMIC_RELEASE);
+				return sock;
+			}
+		}
+		else if (diff < 0)
+		{
+			sched_yield();
+			pos = __atomic_load_n(&queue->dequeuePos, __ATOMIC_RELAXED);
+		}
+		else
+			pos = __atomic_load_n(&queue->dequeuePos, __ATOMIC_RELAXED);
+	}
+}
+
+/*
+Ustvarimo nov vtič, ki bo poslušal in sprejemal nove kliente
+preko TCP/IP protokola. Z reusePort lahko več vtičev posluša
+na istih vratih, jedro pa med njih porazdeli nove povezave.
+*/
+int createListener(int reusePort, int backlog)
+{
+	int iResult;
+
+	int listener = socket(AF_INET, SOCK_STREAM, 0);
+	if (listener == -1)
+	{
+		printf("Error creating socket\n");
+		return -1;
+	}
+
+	if (reusePort)
+	{
+		int enable = 1;
+		if (setsockopt(listener, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) == -1)
+		{
+			printf("Failed to set SO_REUSEPORT\n");
+			close(listener);
+			return -1;
+		}
+	}
+
+	//Nastavimo vrata in mrežni naslov vtiča
+	sockaddr_in listenerConf;
+	listenerConf.sin_port = htons(PORT);
+	listenerConf.sin_family = AF_INET;
+	listenerConf.sin_addr.s_addr = INADDR_ANY;
+
+	//Vtič povežemo z ustreznimi vrati
+	iResult = bind(listener, (sockaddr *)&listenerConf, sizeof(listenerConf));
+	if (iResult == -1)
+	{
+		printf("Bind failed\n");
+		close(listener);
+		return -1;
+	}
+
+	//Začnemo poslušati
+	if (listen(listener, backlog) == -1)
+	{
+		printf("Listen failed\n");
+		close(listener);
+		return -1;
+	}
+
+	return listener;
+}
+
+int parseMode(const char* arg)
+{
+	if (strcmp(arg, "thread") == 0)
+		return MODE_THREAD;
+	if (strcmp(arg, "epoll") == 0)
+		return MODE_EPOLL;
+	if (strcmp(arg, "reactor") == 0)
+		return MODE_REACTOR;
+	if (strcmp(arg, "uring") == 0)
+		return MODE_URING;
+	if (strcmp(arg, "splice") == 0)
+		return MODE_SPLICE;
+	if (strcmp(arg, "pool") == 0)
+		return MODE_POOL;
+	if (strcmp(arg, "frame") == 0)
+		return MODE_FRAME;
+	return -1;
+}
+
+int setNonBlocking(int sock)
+{
+	int flags = fcntl(sock, F_GETFL, 0);
+	if (flags == -1)
+		return -1;
+	return fcntl(sock, F_SETFL, flags | O_NONBLOCK);
+}
+
+/*
+Število hkratnih povezav v epoll načinu omejuje le število
+datotečnih deskriptorjev, zato mehko omejitev dvignemo na trdo.
+*/
+void raiseFileLimit()
+{
+	rlimit limit;
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max)
+	{
+		limit.rlim_cur = limit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &limit);
+	}
+}
+
+int runEpoll(int listener, int maxConnCount)
+{
+	raiseFileLimit();
+
+	if (setNonBlocking(listener) == -1)
+	{
+		printf("Failed to set listener non-blocking\n");
+		return 1;
+	}
+
+	int epollFd = epoll_create1(0);
+	if (epollFd == -1)
+	{
+		printf("Error creating epoll instance\n");
+		return 1;
+	}
+
+	//Poslušalca označimo z NULL, povezave pa s kazalcem na njihovo stanje
+	epoll_event event;
+	event.events = EPOLLIN | EPOLLET;
+	event.data.ptr = NULL;
+	if (epoll_ctl(epollFd, EPOLL_CTL_ADD, listener, &event) == -1)
+	{
+		printf("Failed to register listener\n");
+		close(epollFd);
+		return 1;
+	}
+
+	epoll_event events[MAX_EVENTS];
+	int connCount = 0;
+	int fdLimited = 0;
+	while (1)
+	{
+		int ready = epoll_wait(epollFd, events, MAX_EVENTS, -1);
+		if (ready == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			printf("epoll_wait failed\n");
+			break;
+		}
+
+		for (int i = 0; i < ready; i++)
+		{
+			connection* conn = (connection*) events[i].data.ptr;
+			if (conn == NULL)
+			{
+				fdLimited = acceptConnections(epollFd, listener, maxConnCount, &connCount);
+				if (fdLimited == -1)
+				{
+					close(epollFd);
+					return 1;
+				}
+				continue;
+			}
+
+			int keep;
+			if (useSplice)
+				keep = serveConnectionSplice(conn);
+			else if (useFraming)
+				keep = serveConnectionFramed(conn);
+			else
+				keep = serveConnection(conn);
+			if ((events[i].events & EPOLLERR) || !keep)
+			{
+				closeConnection(conn);
+				statsAdd(&threadStats->closed, 1);
+				connCount--;
+
+				//Sproščeni opisnik takoj porabimo za povezavo, ki čaka v vrsti
+				if (fdLimited)
+				{
+					fdLimited = acceptConnections(epollFd, listener, maxConnCount, &connCount);
+					if (fdLimited == -1)
+					{
+						close(epollFd);
+						return 1;
+					}
+				}
+			}
+		}
+	}
+
+	close(epollFd);
+	return 1;
+}
+
+/*
+Zažene reactorCount niti, vsaka s svojim poslušalcem, epoll instanco
+in števcem povezav, tako da si niti ne delijo nobene ključavnice.
+Največje število povezav enakomerno razdelimo med reaktorje.
+*/
+int runReactors(int maxConnCount, int reactorCount)
+{
+	if (reactorCount < 1)
+		reactorCount = 1;
+
+	raiseFileLimit();
+
+	pthread_t threads[reactorCount];
+	reactorArgs args[reactorCount];
+	for (int i = 0; i < reactorCount; i++)
+	{
+		args[i].index = i;
+		//Ostanek dobijo prvi reaktorji, da vsota ne preseže maxConnCount
+		args[i].maxConnCount = maxConnCount / reactorCount + (i < maxConnCount % reactorCount);
+
+		int err = pthread_create(&threads[i], NULL, runReactor, &args[i]);
+		if (err) {
+			printf("Failed to create reactor thread: %d", err);
+			return err;
+		}
+	}
+
+	for (int i = 0; i < reactorCount; i++)
+		pthread_join(threads[i], NULL);
+
+	return 1;
+}
+
+void* runReactor(void* arg)
+{
+	reactorArgs* args = (reactorArgs*) arg;
+	statsClaimSlot();
+
+	//Reaktor pripnemo na index-to dovoljeno jedro, da ostanejo njegovi podatki v lokalnem predpomnilniku
+	cpu_set_t allowed;
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0)
+	{
+		int target = args->index % CPU_COUNT(&allowed);
+		for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+		{
+			if (CPU_ISSET(cpu, &allowed) && target-- == 0)
+			{
+				cpu_set_t cpus;
+				CPU_ZERO(&cpus);
+				CPU_SET(cpu, &cpus);
+				pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+				break;
+			}
+		}
+	}
+
+	int listener = createListener(1, SOMAXCONN);
+	if (listener != -1)
+	{
+		runEpoll(listener, args->maxConnCount);
+		close(listener);
+	}
+
+	return nullptr;
+}
+
+/*
+Zaradi robnega proženja (EPOLLET) moramo sprejeti vse čakajoče
+povezave, dokler accept ne vrne EAGAIN. Ko zmanjka opisnikov, vrne
+ACCEPT_FD_LIMIT: povezave ostanejo v vrsti poslušalca, a ta ne bo več
+sprožil dogodka, zato klicatelj sprejem ponovi, ko zapre kakšno povezavo.
+*/
+int acceptConnections(int epollFd, int listener, int maxConnCount, int* connCount)
+{
+	while (1)
+	{
+		int clientSock = accept4(listener, NULL, NULL, SOCK_NONBLOCK);
+		if (clientSock == -1)
+		{
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			if (errno == EMFILE || errno == ENFILE)
+			{
+				logMessage(LOG_ERROR, "Out of file descriptors. Pending connections wait for a free one\n", 0);
+				return ACCEPT_FD_LIMIT;
+			}
+			printf("Accept failed\n");
+			return -1;
+		}
+
+		if (*connCount >= maxConnCount)
+		{
+			statsAdd(&threadStats->rejected, 1);
+			logMessage(LOG_WARN, "Max connection count reached. Closing new socket\n", 0);
+			close(clientSock);
+			continue;
+		}
+
+		connection* conn = (connection*) malloc(sizeof(connection));
+		conn->sock = clientSock;
+		conn->pending = 0;
+		conn->offset = 0;
+		conn->filled = 0;
+		conn->frameStart = 0;
+		conn->pipe[0] = -1;
+		conn->pipe[1] = -1;
+		conn->buff.data = NULL;
+
+		if (useSplice)
+		{
+			if (pipe2(conn->pipe, O_NONBLOCK) == -1)
+			{
+				logMessage(LOG_ERROR, "Failed to create pipe\n", 0);
+				close(clientSock);
+				free(conn);
+				continue;
+			}
+			//Večja cev pomeni manj klicev splice za velike prenose
+			conn->pipeSize = fcntl(conn->pipe[1], F_SETPIPE_SZ, SPLICE_PIPE_SIZE);
+			if (conn->pipeSize == -1)
+				conn->pipeSize = fcntl(conn->pipe[1], F_GETPIPE_SZ);
+		}
+		else
+			bufferInit(&conn->buff);
+
+		epoll_event event;
+		event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+		event.data.ptr = conn;
+		if (epoll_ctl(epollFd, EPOLL_CTL_ADD, clientSock, &event) == -1)
+		{
+			logMessage(LOG_ERROR, "Failed to register client socket\n", 0);
+			closeConnection(conn);
+			continue;
+		}
+		statsAdd(&threadStats->accepted, 1);
+		(*connCount)++;
+	}
+}
+
+/*
+Odmev na neblokirajočem vtiču: najprej pošljemo morebitne zaostale
+podatke, nato beremo, dokler jih jedro ima. Vrne 0, ko je treba
+povezavo zapreti, sicer 1.
+*/
+int serveConnection(connection* conn)
+{
+	while (1)
+	{
+		while (conn->offset < conn->pending)
+		{
+			int iResult = send(conn->sock, conn->buff.data + conn->offset, conn->pending - conn->offset, MSG_NOSIGNAL);
+			if (iResult == -1)
+			{
+				if (errno == EAGAIN || errno == EWOULDBLOCK)
+					return 1;
+				if (errno == EINTR)
+					continue;
+				logMessage(LOG_WARN, "send failed!\n", 0);
+				return 0;
+			}
+			logMessage(LOG_DEBUG, "Bytes sent: %lld\n", iResult);
+			statsAdd(&threadStats->bytesOut, iResult);
+			conn->offset += iResult;
+		}
+		if (conn->pending > 0)
+			bufferAdapt(&conn->buff, conn->pending);
+		conn->pending = 0;
+		conn->offset = 0;
+
+		int iResult = recv(conn->sock, conn->buff.data, 1 << conn->buff.shift, 0);
+		if (iResult > 0)
+		{
+			logMessage(LOG_DEBUG, "Bytes received: %lld\n", iResult);
+			statsAdd(&threadStats->bytesIn, iResult);
+			conn->pending = iResult;
+		}
+		else if (iResult == 0)
+		{
+			logMessage(LOG_DEBUG, "Connection closing...\n", 0);
+			return 0;
+		}
+		else if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return 1;
+		else if (errno != EINTR)
+		{
+			logMessage(LOG_WARN, "recv failed!\n", 0);
+			return 0;
+		}
+	}
+}
+
+/*
+Odmev prek io_uring: en večkratni (multishot) accept, en večkratni recv
+na povezavo z medpomnilniki iz skupine, ki jo izbira jedro, in odgovor
+z enim IORING_OP_SENDMSG prek vseh čakajočih medpomnilnikov povezave.
+Vse zahteve, nastale med obdelavo ene serije dogodkov, oddamo skupaj z
+enim klicem io_uring_enter.
+*/
+int runUring(int listener, int maxConnCount)
+{
+	uring* ring = (uring*) calloc(1, sizeof(uring));
+	ring->listener = listener;
+	ring->maxConnCount = maxConnCount;
+
+	if (uringSetup(ring) == -1)
+	{
+		free(ring);
+		return URING_UNSUPPORTED;
+	}
+	if (!uringSupported(ring) || uringSetupBuffers(ring) == -1)
+	{
+		uringDestroy(ring);
+		return URING_UNSUPPORTED;
+	}
+
+	raiseFileLimit();
+	uringArmAccept(ring);
+
+	while (1)
+	{
+		if (uringSubmitAndWait(ring) == -1)
+		{
+			printf("io_uring_enter failed\n");
+			break;
+		}
+
+		unsigned head = *ring->cqHead;
+		unsigned tail = __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE);
+		for (; head != tail; head++)
+			uringHandleCqe(ring, &ring->cqes[head & *ring->cqMask]);
+		__atomic_store_n(ring->cqHead, head, __ATOMIC_RELEASE);
+
+		//Povezave, ki so ostale brez medpomnilnikov, ponovno poslušamo
+		if (ring->recycled)
+		{
+			while (ring->starved != NULL)
+			{
+				uringConnection* conn = ring->starved;
+				ring->starved = conn->nextStarved;
+				conn->nextStarved = NULL;
+				conn->starved = 0;
+				if (conn->closing)
+					uringClose(ring, conn);
+				else
+					uringResumeRecv(ring, conn);
+			}
+			ring->recycled = 0;
+		}
+	}
+
+	uringDestroy(ring);
+	return 1;
+}
+
+int uringSetup(uring* ring)
+{
+	io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	ring->fd = (int) syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+	if (ring->fd == -1)
+		return -1;
+	if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_NODROP))
+	{
+		close(ring->fd);
+		return -1;
+	}
+
+	size_t sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	size_t cqSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+	ring->ringSize = sqSize > cqSize ? sqSize : cqSize;
+	ring->sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+
+	ring->ringPtr = (char*) mmap(NULL, ring->ringSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (ring->ringPtr == MAP_FAILED)
+	{
+		close(ring->fd);
+		return -1;
+	}
+	ring->sqes = (io_uring_sqe*) mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED)
+	{
+		munmap(ring->ringPtr, ring->ringSize);
+		close(ring->fd);
+		return -1;
+	}
+
+	ring->sqEntries = params.sq_entries;
+	ring->sqHead = (unsigned*) (ring->ringPtr + params.sq_off.head);
+	ring->sqTail = (unsigned*) (ring->ringPtr + params.sq_off.tail);
+	ring->sqMask = (unsigned*) (ring->ringPtr + params.sq_off.ring_mask);
+	ring->sqArray = (unsigned*) (ring->ringPtr + params.sq_off.array);
+	ring->sqLocalTail = *ring->sqTail;
+	ring->cqHead = (unsigned*) (ring->ringPtr + params.cq_off.head);
+	ring->cqTail = (unsigned*) (ring->ringPtr + params.cq_off.tail);
+	ring->cqMask = (unsigned*) (ring->ringPtr + params.cq_off.ring_mask);
+	ring->cqes = (io_uring_cqe*) (ring->ringPtr + params.cq_off.cqes);
+	return 0;
+}
+
+/*
+Večkratni recv in IORING_OP_SEND_ZC sta prišla v isti različici jedra
+(6.0), zato prisotnost slednjega uporabimo kot znak, da jedro podpira
+vse, kar potrebujemo.
+*/
+int uringSupported(uring* ring)
+{
+	size_t len = sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op);
+	io_uring_probe* probe = (io_uring_probe*) calloc(1, len);
+	if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE, probe, 256) == -1)
+	{
+		free(probe);
+		return 0;
+	}
+
+	int ops[] = { IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SENDMSG, IORING_OP_ASYNC_CANCEL, IORING_OP_SEND_ZC };
+	int supported = 1;
+	for (unsigned i = 0; i < sizeof(ops) / sizeof(ops[0]); i++)
+	{
+		if (ops[i] > probe->last_op || !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED))
+			supported = 0;
+	}
+
+	free(probe);
+	return supported;
+}
+
+/*
+Pomnilnik registriramo kot obroč medpomnilnikov, iz katerega jedro
+samo izbira ob prejemu.
+*/
+int uringSetupBuffers(uring* ring)
+{
+	size_t total = (size_t) URING_BUFFER_COUNT * URING_BUFFER_SIZE;
+	ring->buffers = (char*) mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+	if (ring->buffers == MAP_FAILED)
+	{
+		ring->buffers = NULL;
+		return -1;
+	}
+
+	ring->bufRing = (io_uring_buf_ring*) mmap(NULL, URING_BUFFER_COUNT * sizeof(io_uring_buf), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ring->bufRing == MAP_FAILED)
+	{
+		ring->bufRing = NULL;
+		return -1;
+	}
+
+	io_uring_buf_reg reg;
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (__u64) (unsigned long) ring->bufRing;
+	reg.ring_entries = URING_BUFFER_COUNT;
+	reg.bgid = 0;
+	if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1)
+		return -1;
+
+	ring->bufTail = 0;
+	for (int i = 0; i < URING_BUFFER_COUNT; i++)
+		uringRecycle(ring, i);
+	ring->recycled = 0;
+	return 0;
+}
+
+void uringDestroy(uring* ring)
+{
+	if (ring->bufRing != NULL)
+		munmap(ring->bufRing, URING_BUFFER_COUNT * sizeof(io_uring_buf));
+	if (ring->buffers != NULL)
+		munmap(ring->buffers, (size_t) URING_BUFFER_COUNT * URING_BUFFER_SIZE);
+	munmap(ring->sqes, ring->sqesSize);
+	munmap(ring->ringPtr, ring->ringSize);
+	close(ring->fd);
+	free(ring);
+}
+
+io_uring_sqe* uringGetSqe(uring* ring)
+{
+	//Če je vrsta polna, jo oddamo, ne da bi čakali na dogodke
+	while (ring->sqLocalTail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE) >= ring->sqEntries)
+	{
+		unsigned toSubmit = ring->sqLocalTail - *ring->sqTail;
+		__atomic_store_n(ring->sqTail, ring->sqLocalTail, __ATOMIC_RELEASE);
+		syscall(__NR_io_uring_enter, ring->fd, toSubmit, 0, 0, NULL, 0);
+	}
+
+	unsigned index = ring->sqLocalTail & *ring->sqMask;
+	io_uring_sqe* sqe = &ring->sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	ring->sqArray[index] = index;
+	ring->sqLocalTail++;
+	return sqe;
+}
+
+int uringSubmitAndWait(uring* ring)
+{
+	unsigned toSubmit = ring->sqLocalTail - *ring->sqTail;
+	__atomic_store_n(ring->sqTail, ring->sqLocalTail, __ATOMIC_RELEASE);
+
+	while (syscall(__NR_io_uring_enter, ring->fd, toSubmit, 1, IORING_ENTER_GETEVENTS, NULL, 0) == -1)
+	{
+		if (errno != EINTR && errno != EBUSY)
+			return -1;
+		//Ob EBUSY najprej poberemo dogodke, ki jih že imamo
+		if (errno == EBUSY && *ring->cqHead != __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE))
+			return 0;
+		toSubmit = 0;
+	}
+	return 0;
+}
+
+void uringRecycle(uring* ring, int bid)
+{
+	//bufs[] v C++ ni na odmiku 0 (prazna struktura v __DECLARE_FLEX_ARRAY), zato indeksiramo sami
+	io_uring_buf* buf = (io_uring_buf*) ring->bufRing + (ring->bufTail & (URING_BUFFER_COUNT - 1));
+	buf->addr = (__u64) (unsigned long) (ring->buffers + (size_t) bid * URING_BUFFER_SIZE);
+	buf->len = URING_BUFFER_SIZE;
+	buf->bid = bid;
+	ring->bufTail++;
+	__atomic_store_n(&ring->bufRing->tail, ring->bufTail, __ATOMIC_RELEASE);
+	ring->recycled = 1;
+}
+
+void uringArmAccept(uring* ring)
+{
+	io_uring_sqe* sqe = uringGetSqe(ring);
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = ring->listener;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->user_data = URING_ACCEPT;
+}
+
+void uringArmRecv(uring* ring, uringConnection* conn)
+{
+	io_uring_sqe* sqe = uringGetSqe(ring);
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = conn->sock;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = 0;
+	sqe->user_data = (__u64) (unsigned long) conn | URING_RECV;
+	conn->receiving = 1;
+	conn->refs++;
+}
+
+//Ustavimo večkratni recv povezave, katere vrsta je polna
+void uringCancelRecv(uring* ring, uringConnection* conn)
+{
+	io_uring_sqe* sqe = uringGetSqe(ring);
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->addr = (__u64) (unsigned long) conn | URING_RECV;
+	sqe->user_data = (__u64) (unsigned long) conn | URING_CANCEL;
+	conn->cancelling = 1;
+	conn->refs++;
+}
+
+//Povezavo, ki ne posluša, spet poslušamo, ko se njena vrsta dovolj izprazni
+void uringResumeRecv(uring* ring, uringConnection* conn)
+{
+	if (!conn->receiving && !conn->starved && !conn->readDone && !conn->closing
+		&& conn->queued <= URING_CONN_BUFFERS / 2)
+		uringArmRecv(ring, conn);
+}
+
+/*
+Pošljemo do URING_WRITE_BATCH medpomnilnikov iz vrste povezave naenkrat,
+prvega od odmika naprej, da sporočilo čez več medpomnilnikov ne čaka
+na potrditve posameznih kosov.
+*/
+void uringWrite(uring* ring, uringConnection* conn)
+{
+	int count = 0;
+	int offset = conn->offset;
+	for (int bid = conn->queueHead; bid != -1 && count < URING_WRITE_BATCH; bid = ring->bufferNext[bid])
+	{
+		conn->iov[count].iov_base = ring->buffers + (size_t) bid * URING_BUFFER_SIZE + offset;
+		conn->iov[count].iov_len = ring->bufferLen[bid] - offset;
+		offset = 0;
+		count++;
+	}
+	memset(&conn->msg, 0, sizeof(conn->msg));
+	conn->msg.msg_iov = conn->iov;
+	conn->msg.msg_iovlen = count;
+
+	io_uring_sqe* sqe = uringGetSqe(ring);
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = conn->sock;
+	sqe->addr = (__u64) (unsigned long) &conn->msg;
+	sqe->len = 1;
+	sqe->msg_flags = MSG_NOSIGNAL;
+	sqe->user_data = (__u64) (unsigned long) conn | URING_WRITE;
+	conn->writing = 1;
+	conn->refs++;
+}
+
+/*
+Povezavo zapremo v dveh korakih: shutdown prekine večkratni recv,
+vtič pa zapremo in sprostimo, ko jedro vrne vse operacije.
+*/
+void uringClose(uring* ring, uringConnection* conn)
+{
+	if (!conn->closing)
+	{
+		conn->closing = 1;
+		shutdown(conn->sock, SHUT_RDWR);
+	}
+	if (conn->refs > 0 || conn->starved)
+		return;
+
+	while (conn->queueHead != -1)
+	{
+		int bid = conn->queueHead;
+		conn->queueHead = ring->bufferNext[bid];
+		uringRecycle(ring, bid);
+	}
+	close(conn->sock);
+	free(conn);
+	statsAdd(&threadStats->closed, 1);
+	ring->connCount--;
+}
+
+void uringHandleCqe(uring* ring, io_uring_cqe* cqe)
+{
+	int op = (int) (cqe->user_data & URING_OP_MASK);
+	uringConnection* conn = (uringConnection*) (unsigned long) (cqe->user_data & ~(__u64) URING_OP_MASK);
+	int more = cqe->flags & IORING_CQE_F_MORE;
+
+	if (op == URING_ACCEPT)
+	{
+		if (cqe->res >= 0)
+		{
+			if (ring->connCount >= ring->maxConnCount)
+			{
+				statsAdd(&threadStats->rejected, 1);
+				logMessage(LOG_WARN, "Max connection count reached. Closing new socket\n", 0);
+				close(cqe->res);
+			}
+			else
+			{
+				//Brez Naglovega algoritma rep sporočila ne čaka na zakasnjeno potrditev
+				int noDelay = 1;
+				setsockopt(cqe->res, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+				uringConnection* client = (uringConnection*) calloc(1, sizeof(uringConnection));
+				client->sock = cqe->res;
+				client->queueHead = -1;
+				client->queueTail = -1;
+				statsAdd(&threadStats->accepted, 1);
+				ring->connCount++;
+				uringArmRecv(ring, client);
+			}
+		}
+		else if (cqe->res != -EAGAIN && cqe->res != -EINTR)
+			logMessage(LOG_ERROR, "Accept failed: %lld\n", -cqe->res);
+
+		if (!more)
+			uringArmAccept(ring);
+		return;
+	}
+
+	if (op == URING_CANCEL)
+	{
+		conn->cancelling = 0;
+		conn->refs--;
+		if (conn->closing)
+			uringClose(ring, conn);
+		return;
+	}
+
+	if (op == URING_RECV)
+	{
+		if (!more)
+		{
+			conn->refs--;
+			conn->receiving = 0;
+		}
+
+		if (cqe->res > 0)
+		{
+			int bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+			logMessage(LOG_DEBUG, "Bytes received: %lld\n", cqe->res);
+			statsAdd(&threadStats->bytesIn, cqe->res);
+			if (conn->closing)
+			{
+				uringRecycle(ring, bid);
+			}
+			else
+			{
+				ring->bufferLen[bid] = cqe->res;
+				ring->bufferNext[bid] = -1;
+				if (conn->queueHead == -1)
+					conn->queueHead = bid;
+				else
+					ring->bufferNext[conn->queueTail] = bid;
+				conn->queueTail = bid;
+				conn->queued++;
+				if (!conn->writing)
+					uringWrite(ring, conn);
+			}
+			if (conn->closing)
+				uringClose(ring, conn);
+			else if (conn->queued >= URING_CONN_BUFFERS)
+			{
+				if (more && !conn->cancelling)
+					uringCancelRecv(ring, conn);
+			}
+			else if (!more)
+				uringArmRecv(ring, conn);
+		}
+		else if (cqe->res == -ECANCELED && !conn->closing)
+		{
+			//Preklic zaradi polne vrste; vrsta se je morda že izpraznila
+			uringResumeRecv(ring, conn);
+		}
+		else if (cqe->res == -ENOBUFS && !conn->closing)
+		{
+			//Obroč je prazen, povezavo ponovno poslušamo, ko se medpomnilniki vrnejo
+			conn->starved = 1;
+			conn->nextStarved = ring->starved;
+			ring->starved = conn;
+		}
+		else if (cqe->res == 0 && !conn->closing)
+		{
+			//Klient ne bo več pošiljal, a odmev že prejetih podatkov mora še dobiti
+			logMessage(LOG_DEBUG, "Connection closing...\n", 0);
+			conn->readDone = 1;
+			if (!conn->writing)
+				uringClose(ring, conn);
+		}
+		else
+		{
+			if (cqe->res < 0 && !conn->closing)
+				logMessage(LOG_WARN, "recv failed!\n", 0);
+			uringClose(ring, conn);
+		}
+		return;
+	}
+
+	conn->writing = 0;
+	conn->refs--;
+	if (cqe->res < 0)
+	{
+		if (!conn->closing)
+			logMessage(LOG_WARN, "send failed!\n", 0);
+		uringClose(ring, conn);
+		return;
+	}
+
+	logMessage(LOG_DEBUG, "Bytes sent: %lld\n", cqe->res);
+	statsAdd(&threadStats->bytesOut, cqe->res);
+	//Poslane medpomnilnike vrnemo v obroč, pri delno poslanem si zapomnimo odmik
+	int sent = cqe->res;
+	while (sent > 0)
+	{
+		int bid = conn->queueHead;
+		int left = ring->bufferLen[bid] - conn->offset;
+		if (sent < left)
+		{
+			conn->offset += sent;
+			break;
+		}
+		sent -= left;
+		conn->queueHead = ring->bufferNext[bid];
+		conn->offset = 0;
+		conn->queued--;
+		uringRecycle(ring, bid);
+	}
+
+	if (conn->queueHead != -1 && !conn->closing)
+	{
+		uringWrite(ring, conn);
+		uringResumeRecv(ring, conn);
+	}
+	else if (conn->closing || conn->readDone)
+		uringClose(ring, conn);
+	else
+		uringResumeRecv(ring, conn);
+}
+
+/*
+Odmev brez kopiranja v uporabniški prostor: podatke s splice prestavimo
+iz vtiča v cev povezave in iz cevi nazaj v vtič. V pending hranimo,
+koliko bajtov je še v cevi.
+*/
+int serveConnectionSplice(connection* conn)
+{
+	while (1)
+	{
+		while (conn->pending > 0)
+		{
+			ssize_t iResult = splice(conn->pipe[0], NULL, conn->sock, NULL, conn->pending, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+			if (iResult == -1)
+			{
+				if (errno == EAGAIN || errno == EWOULDBLOCK)
+					return 1;
+				if (errno == EINTR)
+					continue;
+				logMessage(LOG_WARN, "send failed!\n", 0);
+				return 0;
+			}
+			logMessage(LOG_DEBUG, "Bytes sent: %lld\n", iResult);
+			statsAdd(&threadStats->bytesOut, iResult);
+			conn->pending -= (int) iResult;
+		}
+
+		ssize_t iResult = splice(conn->sock, NULL, conn->pipe[1], NULL, conn->pipeSize, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (iResult > 0)
+		{
+			logMessage(LOG_DEBUG, "Bytes received: %lld\n", iResult);
+			statsAdd(&threadStats->bytesIn, iResult);
+			conn->pending = (int) iResult;
+		}
+		else if (iResult == 0)
+		{
+			logMessage(LOG_DEBUG, "Connection closing...\n", 0);
+			return 0;
+		}
+		else if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return 1;
+		else if (errno != EINTR)
+		{
+			logMessage(LOG_WARN, "recv failed!\n", 0);
+			return 0;
+		}
+	}
+}
+
+//Zaprt vtič se samodejno odstrani iz epoll instance
+void closeConnection(connection* conn)
+{
+	close(conn->sock);
+	if (conn->pipe[0] != -1)
+	{
+		close(conn->pipe[0]);
+		close(conn->pipe[1]);
+	}
+	if (conn->buff.data != NULL)
+		bufferFree(&conn->buff);
+	free(conn);
+}
+
+/*
+Vrne medpomnilnik velikosti 1 << shift. Prosti medpomnilniki so povezani
+v seznam kar prek svojih prvih bajtov. Če bi nov medpomnilnik presegel
+omejitev, najprej sprostimo proste iz bazena; brez force takrat vrnemo NULL.
+*/
+char* poolAcquire(int shift, int force)
+{
+	int index = shift - POOL_MIN_SHIFT;
+	long long size = 1LL << shift;
+
+	pthread_mutex_lock(&pool.lock);
+	char* data = pool.freeList[index];
+	if (data != NULL)
+	{
+		pool.freeList[index] = *((char**) data);
+		pthread_mutex_unlock(&pool.lock);
+		return data;
+	}
+
+	for (int i = POOL_CLASSES - 1; i >= 0 && pool.allocated + size > POOL_MAX_BYTES; i--)
+	{
+		while (pool.freeList[i] != NULL && pool.allocated + size > POOL_MAX_BYTES)
+		{
+			char* victim = pool.freeList[i];
+			pool.freeList[i] = *((char**) victim);
+			pool.allocated -= 1LL << (i + POOL_MIN_SHIFT);
+			free(victim);
+		}
+	}
+
+	if (!force && pool.allocated + size > POOL_MAX_BYTES)
+	{
+		pthread_mutex_unlock(&pool.lock);
+		return NULL;
+	}
+	pool.allocated += size;
+	pthread_mutex_unlock(&pool.lock);
+
+	return (char*) malloc(size);
+}
+
+void poolRelease(char* data, int shift)
+{
+	int index = shift - POOL_MIN_SHIFT;
+
+	pthread_mutex_lock(&pool.lock);
+	*((char**) data) = pool.freeList[index];
+	pool.freeList[index] = data;
+	pthread_mutex_unlock(&pool.lock);
+}
+
+void bufferInit(clientBuffer* buff)
+{
+	buff->shift = POOL_MIN_SHIFT;
+	buff->smallReads = 0;
+	buff->data = poolAcquire(buff->shift, 1);
+}
+
+//Klicati, ko je medpomnilnik prazen (vse prejeto je že poslano)
+void bufferAdapt(clientBuffer* buff, int received)
+{
+	int newShift = buff->shift;
+	if (received == 1 << buff->shift)
+	{
+		buff->smallReads = 0;
+		if (buff->shift < POOL_MAX_SHIFT)
+			newShift = buff->shift + 1;
+	}
+	else if (received < (1 << buff->shift) / 4)
+	{
+		if (++buff->smallReads >= SHRINK_AFTER && buff->shift > POOL_MIN_SHIFT)
+			newShift = buff->shift - 1;
+	}
+	else
+		buff->smallReads = 0;
+
+	if (newShift == buff->shift)
+		return;
+
+	bufferResize(buff, newShift, 0, newShift < buff->shift);
+}
+
+//Zamenja medpomnilnik z drugim razredom in ohrani prvih keep bajtov; vrne 0, če ni šlo
+int bufferResize(clientBuffer* buff, int shift, int keep, int force)
+{
+	char* data = poolAcquire(shift, force);
+	if (data == NULL)
+		return 0;
+
+	if (keep > 0)
+		memcpy(data, buff->data, keep);
+	poolRelease(buff->data, buff->shift);
+	buff->data = data;
+	buff->shift = shift;
+	buff->smallReads = 0;
+	return 1;
+}
+
+void bufferFree(clientBuffer* buff)
+{
+	poolRelease(buff->data, buff->shift);
+	buff->data = NULL;
+}
+
+void statsAdd(long long* counter, long long value)
+{
+	__atomic_fetch_add(counter, value, __ATOMIC_RELAXED);
+}
+
+void statsClaimSlot()
+{
+	threadStats = &stats[__atomic_fetch_add(&nextStatsSlot, 1, __ATOMIC_RELAXED) % STATS_SLOTS];
+}
+
+//Števci se med seštevanjem lahko spreminjajo, zato je izpis le približen posnetek
+void printStats()
+{
+	long long accepted = 0, rejected = 0, closed = 0, bytesIn = 0, bytesOut = 0;
+	for (int i = 0; i < STATS_SLOTS; i++)
+	{
+		accepted += __atomic_load_n(&stats[i].accepted, __ATOMIC_RELAXED);
+		rejected += __atomic_load_n(&stats[i].rejected, __ATOMIC_RELAXED);
+		closed += __atomic_load_n(&stats[i].closed, __ATOMIC_RELAXED);
+		bytesIn += __atomic_load_n(&stats[i].bytesIn, __ATOMIC_RELAXED);
+		bytesOut += __atomic_load_n(&stats[i].bytesOut, __ATOMIC_RELAXED);
+	}
+	printf("Accepted: %lld, rejected: %lld, active: %lld, bytes in: %lld, bytes out: %lld\n",
+		accepted, rejected, accepted - closed, bytesIn, bytesOut);
+	fflush(stdout);
+}
+
+void* reportStats(void*)
+{
+	sigset_t statsSignal;
+	sigemptyset(&statsSignal);
+	sigaddset(&statsSignal, SIGUSR1);
+
+	int sig;
+	while (sigwait(&statsSignal, &sig) == 0)
+		printStats();
+
+	return nullptr;
+}
+
+int parseLogLevel(const char* arg)
+{
+	const char* names[] = { "error", "warn", "info", "debug" };
+	for (int i = LOG_ERROR; i <= LOG_DEBUG; i++)
+	{
+		if (strcmp(arg, names[i]) == 0)
+			return i;
+	}
+	return -1;
+}
+
+void startLogger()
+{
+	logs = (logQueue*) calloc(1, sizeof(logQueue));
+	for (unsigned long long i = 0; i < LOG_QUEUE_SIZE; i++)
+		logs->records[i].sequence = i;
+
+	pthread_t logThread;
+	if (pthread_create(&logThread, NULL, drainLog, NULL) == 0)
+		pthread_detach(logThread);
+}
+
+//Format mora biti nespremenljiv niz, saj ga nit v ozadju uporabi kasneje
+void logMessage(int level, const char* format, long long value)
+{
+	if (level > logLevel)
+		return;
+	if (level == LOG_DEBUG && logSampleRate > 1 && ++logSampleCounter % logSampleRate != 0)
+		return;
+
+	unsigned long long pos = __atomic_load_n(&logs->enqueuePos, __ATOMIC_RELAXED);
+	while (1)
+	{
+		logRecord* record = &logs->records[pos & (LOG_QUEUE_SIZE - 1)];
+		long long diff = (long long) (__atomic_load_n(&record->sequence, __ATOMIC_ACQUIRE) - pos);
+		if (diff == 0)
+		{
+			if (__atomic_compare_exchange_n(&logs->enqueuePos, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			{
+				record->level = level;
+				record->format = format;
+				record->value = value;
+				__atomic_store_n(&record->sequence, pos + 1, __ATOMIC_RELEASE);
+				return;
+			}
+		}
+		else if (diff < 0)
+		{
+			__atomic_fetch_add(&logs->dropped, 1, __ATOMIC_RELAXED);
+			return;
+		}
+		else
+			pos = __atomic_load_n(&logs->enqueuePos, __ATOMIC_RELAXED);
+	}
+}
+
+void* drainLog(void*)
+{
+	const char* names[] = { "ERROR", "WARN", "INFO", "DEBUG" };
+	long long reportedDropped = 0;
+
+	//Bralec je en sam, zato položaja ni treba zamenjati atomarno
+	unsigned long long pos = 0;
+	while (1)
+	{
+		logRecord* record = &logs->records[pos & (LOG_QUEUE_SIZE - 1)];
+		if (__atomic_load_n(&record->sequence, __ATOMIC_ACQUIRE) == pos + 1)
+		{
+			printf("[%s] ", names[record->level]);
+			printf(record->format, record->value);
+			__atomic_store_n(&record->sequence, pos + LOG_QUEUE_SIZE, __ATOMIC_RELEASE);
+			pos++;
+			continue;
+		}
+
+		long long dropped = __atomic_load_n(&logs->dropped, __ATOMIC_RELAXED);
+		if (dropped != reportedDropped)
+		{
+			printf("[WARN] Log queue full, dropped %lld messages\n", dropped - reportedDropped);
+			reportedDropped = dropped;
+		}
+		fflush(stdout);
+		usleep(LOG_IDLE_US);
+	}
+
+	return nullptr;
+}
+
+/*
+Odmev z okvirji. V medpomnilniku so po vrsti: okvirji, na katere smo
+že odgovorili do frameStart, celotni okvirji do pending in nedokončan
+okvir do filled. Odgovor na okvir ima enako dolžino kot okvir, zato
+offset (že poslani bajti odgovorov) meri kar položaj v medpomnilniku.
+*/
+int serveConnectionFramed(connection* conn)
+{
+	while (1)
+	{
+		if (conn->offset < conn->pending)
+		{
+			int iResult = flushFrames(conn);
+			if (iResult <= 0)
+				return iResult + 1;
+			continue;
+		}
+
+		//Nedokončan okvir premaknemo na začetek medpomnilnika
+		int partial = conn->filled - conn->pending;
+		if (conn->pending > 0)
+		{
+			memmove(conn->buff.data, conn->buff.data + conn->pending, partial);
+			conn->filled = partial;
+			conn->pending = 0;
+			conn->offset = 0;
+			conn->frameStart = 0;
+		}
+
+		//Okvir, ki ne gre v trenutni medpomnilnik, zahteva večjega
+		int capacity = 1 << conn->buff.shift;
+		int needed = capacity;
+		if (partial >= FRAME_HEADER_SIZE)
+			needed = FRAME_HEADER_SIZE + frameLength(conn->buff.data);
+		if (conn->filled == capacity || needed > capacity)
+		{
+			int shift = conn->buff.shift + 1;
+			while (shift < POOL_MAX_SHIFT && (1 << shift) < needed)
+				shift++;
+			if (shift <= POOL_MAX_SHIFT)
+			{
+				bufferResize(&conn->buff, shift, conn->filled, 1);
+				capacity = 1 << conn->buff.shift;
+			}
+		}
+
+		int iResult = recv(conn->sock, conn->buff.data + conn->filled, capacity - conn->filled, 0);
+		if (iResult == 0)
+		{
+			logMessage(LOG_DEBUG, "Connection closing...\n", 0);
+			return 0;
+		}
+		if (iResult == -1)
+		{
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 1;
+			if (errno == EINTR)
+				continue;
+			logMessage(LOG_WARN, "recv failed!\n", 0);
+			return 0;
+		}
+		logMessage(LOG_DEBUG, "Bytes received: %lld\n", iResult);
+		statsAdd(&threadStats->bytesIn, iResult);
+		conn->filled += iResult;
+
+		//Poiščemo vse celotne okvirje, ki so na voljo
+		int pos = conn->pending;
+		while (conn->filled - pos >= FRAME_HEADER_SIZE)
+		{
+			int length = frameLength(conn->buff.data + pos);
+			if (length == -1)
+			{
+				logMessage(LOG_WARN, "Frame too large, closing connection\n", 0);
+				return 0;
+			}
+			if (conn->filled - pos - FRAME_HEADER_SIZE < length)
+				break;
+			pos += FRAME_HEADER_SIZE + length;
+		}
+		conn->pending = pos;
+	}
+}
+
+/*
+Pošlje odgovore na čakajoče okvirje z enim writev: glava odgovora je
+v ločeni tabeli, vsebina pa kaže neposredno v medpomnilnik, tako da je
+nič ne kopiramo. Vrne -1 ob napaki, 0 ob EAGAIN in 1, če je kaj poslal.
+*/
+int flushFrames(connection* conn)
+{
+	uint32_t headers[FRAME_BATCH];
+	iovec iov[2 * FRAME_BATCH];
+	int iovCount = 0;
+
+	int pos = conn->frameStart;
+	for (int frame = 0; frame < FRAME_BATCH && pos < conn->pending; frame++)
+	{
+		int payload = frameLength(conn->buff.data + pos);
+		headers[frame] = htonl((uint32_t) payload);
+
+		//Del okvirja je lahko že poslan ob prejšnjem klicu
+		int skip = conn->offset > pos ? conn->offset - pos : 0;
+		if (skip < FRAME_HEADER_SIZE)
+		{
+			iov[iovCount].iov_base = (char*) &headers[frame] + skip;
+			iov[iovCount].iov_len = FRAME_HEADER_SIZE - skip;
+			iovCount++;
+			skip = 0;
+		}
+		else
+			skip -= FRAME_HEADER_SIZE;
+
+		if (payload > skip)
+		{
+			iov[iovCount].iov_base = conn->buff.data + pos + FRAME_HEADER_SIZE + skip;
+			iov[iovCount].iov_len = payload - skip;
+			iovCount++;
+		}
+		pos += FRAME_HEADER_SIZE + payload;
+	}
+
+	msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = iovCount;
+
+	ssize_t iResult = sendmsg(conn->sock, &msg, MSG_NOSIGNAL);
+	if (iResult == -1)
+	{
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return 0;
+		if (errno == EINTR)
+			return 1;
+		logMessage(LOG_WARN, "send failed!\n", 0);
+		return -1;
+	}
+	logMessage(LOG_DEBUG, "Bytes sent: %lld\n", iResult);
+	statsAdd(&threadStats->bytesOut, iResult);
+
+	conn->offset += (int) iResult;
+	while (conn->frameStart < conn->offset)
+	{
+		int end = conn->frameStart + FRAME_HEADER_SIZE + frameLength(conn->buff.data + conn->frameStart);
+		if (end > conn->offset)
+			break;
+		conn->frameStart = end;
+	}
+	return 1;
+}
+
+//Vrne dolžino vsebine okvirja ali -1, če okvir ne gre v največji medpomnilnik
+int frameLength(const char* header)
+{
+	uint32_t length;
+	memcpy(&length, header, FRAME_HEADER_SIZE);
+	length = ntohl(length);
+	return length > FRAME_MAX_PAYLOAD ? -1 : (int) length;
+}
@@ -2,106 +2,402 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <string.h>
+#include <limits.h>
+#include <limits>
+#include <math.h>
+#include <immintrin.h>
+#include <algorithm>
+#include <functional>
+#include <type_traits>
 
-int* generate(int n);
+#define ALGORITHM_TRANSPOSITION 0
+#define ALGORITHM_SAMPLE 1
+#define ALGORITHM_BLOCK 2
+#define ALGORITHM_RADIX 3
+#define ALGORITHM_COUNT 4
+
+// samples taken per bucket when choosing sample sort splitters
+#define OVERSAMPLING 64
+
+// ranges of at most LEAF_SIZE elements are sorted by a sorting network
+#define LEAF_SIZE 32
+
+// widest radix sort digit, a histogram of 2^11 counts fits in L1
+#define RADIX_BITS 11
+#define RADIX_BUCKETS (1 << RADIX_BITS)
+
+// untimed and timed runs per benchmark configuration
+#define BENCH_WARMUPS 2
+#define BENCH_REPETITIONS 7
+// smallest n of the benchmark sweep, and the largest n "all" gives to the
+// quadratic transposition sort
+#define BENCH_MIN_N 1000
+#define BENCH_TRANSPOSITION_MAX_N 20000
+
+// smallest block, in ints, an external sort stream reads or writes at once
+#define EXTERNAL_MIN_BLOCK (1 << 16)
+
+#define CACHE_LINE 64
+#define CACHE_LINE_INTS (CACHE_LINE / (int) sizeof(int))
+
+// pause iterations a barrier waiter spins before it sleeps on a futex
+#define SPIN_LIMIT 1024
+
+int* generate(int n, int t);
+void createThread(pthread_t* thread, int index, void* (*routine)(void*), void* arg);
+void firstTouch(int* arr, long long n, int t);
+void* evaluateTouch(void* arg);
 void print(int* arr, int n);
 void sort(int* arr, int n, int t);
+void sortTransposition(int* arr, int n, int t);
+template <typename T, typename Less> void sortSample(T* arr, long long n, int t, Less less);
+template <typename T, typename Less> void* evaluateSample(void* arg);
+template <typename T, typename Less> void sortBucket(T* arr, long long n, Less less);
+void sortBucket(int* arr, long long n, std::less<int>);
+void sortBlock(int* arr, int n, int t);
+void* evaluateBlock(void* arg);
+template <typename T, typename Key> void sortRadix(T* arr, long long n, int t, Key key);
+template <typename T, typename Key> void* evaluateRadix(void* arg);
+template <typename K> typename std::make_unsigned<K>::type orderedKey(K key);
+template <typename T, typename Less> void sortBy(T* arr, long long n, int t, Less less);
+template <typename K, typename V> struct record;
+template <typename K, typename V, typename Less = std::less<K>>
+void sortRecords(record<K, V>* arr, long long n, int t, Less less = Less());
+void benchmarkRecords(int n, int t);
+int sortExternal(const char* input, const char* output, long long runSize, int t);
+void ioStart(struct ioQueue* q, int capacity);
+void ioSubmit(struct ioQueue* q, int write, int fd, int* buffer, long long count, off_t offset, int* ready);
+void ioWait(struct ioQueue* q, int* ready);
+void ioStop(struct ioQueue* q);
+void* evaluateIo(void* arg);
+void readerRequest(struct ioQueue* q, int fd, struct runReader* r, int b, long long block);
+void readerAdvance(struct ioQueue* q, int fd, struct runReader* r, long long block);
+int loserBeats(struct runReader* readers, int a, int b);
+int loserBuild(struct runReader* readers, int* losers, int k, int node);
+void mergeLow(int* a, long long countA, int* b, long long countB, int* out, long long count);
+void mergeHigh(int* a, long long countA, int* b, long long countB, int* out, long long count);
+int parseAlgorithm(const char* arg);
+void benchmark(int n, int t, int only);
+int nextThreads(int threads, int t);
+void benchmarkPadding(int n, int t);
+double elapsed(struct timespec* start);
+template <typename T = int> T* allocate(long long n);
+long long chunkStart(int i, long long n, int t, int align);
+void localSort(int* arr, long long n);
+void quickSort(int* arr, long long n, int depth);
+void selectLeaf();
+void sortLeafScalar(int* arr, int n);
+void sortLeafAvx2(int* arr, int n);
+void sortLeafAvx512(int* arr, int n);
 void swap(int* arr, int i, int j);
 int step(int* arr, int n, int t, int start);
 void* evaluate(void* arg);
-void* evaluateControl(void* arg);
+void spinBarrierInit(struct spinBarrier* b, int count);
+int spinBarrierWait(struct spinBarrier* b, int value);
 int min(int a, int b);
 
+// spin-then-block barrier that also ORs together the values passed in by
+// the threads, the result of generation g is collected in reduce[g % 2];
+// the fields live in words, where generation, which is spun on, gets a
+// cache line apart from the counters every arriving thread writes when
+// padded and shares their line otherwise
+struct spinBarrier {
+    int count;
+    int spin;
+    int* arrived;
+    int* sleepers;
+    int* reduce;
+    int* generation;
+    alignas(CACHE_LINE) int words[2 * CACHE_LINE_INTS];
+};
+
 struct params {
     int offset;
     int count;
     int n;
     int index;
     int* arr;
+    struct spinBarrier* barrier;
+};
+
+// state shared by all sample sort threads, counts[i * stride + b] is the
+// number of elements of chunk i that fall into bucket b
+template <typename T, typename Less>
+struct sampleShared {
+    T* arr;
+    T* tmp;
+    long long n;
+    int t;
+    T* splitters;
+    long long* counts;
+    int stride;
+    Less* less;
+    pthread_barrier_t barrier;
+};
+
+template <typename T, typename Less>
+struct sampleParams {
+    int index;
+    sampleShared<T, Less>* shared;
+};
+
+// chunk i of block odd-even sort is [offsets[i], offsets[i + 1]),
+// exchanged[r % 3] is set when some pair merged in round r; it points to
+// a cache line of its own when padded and to packedExchanged, next to the
+// fields every thread reads, otherwise
+struct blockShared {
+    int* arr;
+    int* tmp;
+    int t;
+    long long* offsets;
+    int* exchanged;
+    int packedExchanged[3];
+    pthread_barrier_t barrier;
+};
+
+struct blockParams {
+    int index;
+    struct blockShared* shared;
+};
+
+// unsigned image of the integral key that key(element) returns
+template <typename T, typename Key>
+using radixKey = typename std::make_unsigned<typename std::decay<
+    typename std::invoke_result<Key, const T&>::type>::type>::type;
+
+// counts[i * stride + d] is the number of elements of chunk i with digit d
+// in the current pass, where stride is RADIX_BUCKETS when padded and the
+// digit count otherwise; low and high hold the chunk key extremes
+template <typename T, typename Key>
+struct radixShared {
+    T* arr;
+    T* tmp;
+    long long n;
+    int t;
+    Key* key;
+    radixKey<T, Key>* low;
+    radixKey<T, Key>* high;
+    long long* counts;
+    pthread_barrier_t barrier;
+};
+
+template <typename T, typename Key>
+struct radixParams {
+    int index;
+    radixShared<T, Key>* shared;
+};
+
+// trivially copyable element of the generic sort: records are moved whole,
+// so the payload is sorted in place along with its key
+template <typename K, typename V>
+struct record {
+    K key;
+    V value;
+};
+
+struct touchParams {
+    int* arr;
+    long long start;
+    long long end;
 };
 
-pthread_barrier_t barrierOdd;
-pthread_barrier_t barrierEven;
-pthread_barrier_t barrierProceed;
-int sorted = 0;
-int* changed;
+// a read or write of count ints at offset, ready is set once it is done
+struct ioRequest {
+    int write;
+    int fd;
+    int* buffer;
+    long long count;
+    off_t offset;
+    int* ready;
+};
 
+// requests served in order by a single I/O thread, so the sorting and
+// merging threads never block on the disk unless the data is not there yet
+struct ioQueue {
+    struct ioRequest* requests;
+    int capacity;
+    int head;
+    int tail;
+    int stop;
+    pthread_mutex_t lock;
+    pthread_cond_t submitted;
+    pthread_cond_t completed;
+    pthread_t thread;
+};
+
+// one sorted run [next, end) of the run file, read through two buffers:
+// the merge consumes buffers[current] while the other one is being filled
+struct runReader {
+    off_t next;
+    off_t end;
+    int* buffers[2];
+    long long counts[2];
+    int ready[2];
+    int current;
+    long long position;
+    int done;
+};
+
+const char* algorithmNames[ALGORITHM_COUNT] = {"transposition", "sample", "block", "radix"};
+int algorithm = ALGORITHM_TRANSPOSITION;
+// chunk boundaries, per-thread counters and histograms, and the barrier
+// and flag words threads spin on or write start on their own cache line
+int padded = 1;
+// worker i runs on the i-th allowed cpu and the input is first touched by
+// the worker that sorts it, so its pages are on that worker's NUMA node
+int pinning = 0;
+void (*sortLeaf)(int* arr, int n) = sortLeafScalar;
+
+// command: ./sort <t> <n> <algorithm> [padding|bench|external <input> <output>|records] [pin]
+// t - number of threads
+// n - number of elements
+// algorithm - transposition (odd-even transposition, default), sample (parallel sample sort)
+//             block (odd-even merge-split over sorted per-thread blocks)
+//             or radix (parallel LSD radix sort), all is accepted by bench
+// padding - optional, times the algorithm for 1, 2, 4, ... t threads with and
+//           without cache line padding of the chunks, per-thread counters and
+//           histograms, and the shared barrier and flag words
+// bench - optional, sweeps n, n / 10, ... down to 1000 elements and 1, 2, 4, ... t
+//         threads and prints CSV with the median, min and stddev time in seconds
+// external - sorts the binary ints of file input into file output in runs of
+//            n ints, memory use is about 3n ints
+// records - sorts n (64-bit key, payload) records through the generic API with the
+//           radix fast path and with the comparison sort, the algorithm is not used
+// pin - optional, pins the sorting threads to cpus and places the input on their NUMA nodes
 int main(int argc, char **argv)
 {
     srand(time(NULL));
 
     int t = 1;
     int n = 8;
+    if (argc > 4 && strcmp(argv[argc - 1], "pin") == 0) {
+        pinning = 1;
+        argc--;
+    }
     if (argc > 1) {
         t = atoi(argv[1]);
     }
     if (argc > 2) {
         n = atoi(argv[2]);
     }
+    if (argc > 3) {
+        algorithm = parseAlgorithm(argv[3]);
+        int all = argc > 4 && strcmp(argv[4], "bench") == 0 && strcmp(argv[3], "all") == 0;
+        if (algorithm == -1 && !all) {
+            printf("Unknown algorithm: %s\n", argv[3]);
+            return 1;
+        }
+    }
+    if (argc > 4 && strcmp(argv[4], "padding") == 0) {
+        benchmarkPadding(n, t);
+        return 0;
+    }
+    if (argc > 4 && strcmp(argv[4], "bench") == 0) {
+        benchmark(n, t, algorithm);
+        return 0;
+    }
+    if (argc > 4 && strcmp(argv[4], "records") == 0) {
+        selectLeaf();
+        benchmarkRecords(n, t);
+        return 0;
+    }
+    if (argc > 4 && strcmp(argv[4], "external") == 0) {
+        if (argc < 7) {
+            printf("Usage: %s <t> <n> <algorithm> external <input> <output>\n", argv[0]);
+            return 1;
+        }
+        return sortExternal(argv[5], argv[6], n, t);
+    }
 
-    int* arr = generate(n);
+    int* arr = generate(n, t);
     for (int i = 0; i < t; i++) {
         int ti = (i + 1) * n / t - i * n / t;
     }
     printf("Starting sort\n");
 
-    time_t start = time(NULL);
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
     sort(arr, n, t);
-    time_t end = time(NULL);
 
-    printf("Sort took %ld seconds.\n", end - start);
+    printf("Sort took %.3f seconds.\n", elapsed(&start));
     return 0;
 }
 
 void* evaluate(void* arg) {
     struct params p = *((struct params*) arg);
 
-    while(!sorted) {
+    while (1) {
         int threadChanged = step(p.arr, p.n, p.offset, p.count);
 
-        pthread_barrier_wait(&barrierOdd);
+        spinBarrierWait(p.barrier, 0);
 
         threadChanged |= step(p.arr, p.n, p.offset + 1, p.count);
 
-        if (threadChanged) {
-            changed[p.index] = 1;
+        // sorted once no thread swapped anything in either phase
+        if (!spinBarrierWait(p.barrier, threadChanged)) {
+            break;
         }
-        pthread_barrier_wait(&barrierEven);
-
-        pthread_barrier_wait(&barrierProceed);
     }
 
     return nullptr;
 }
 
-void* evaluateControl(void* arg) {
-    int t = *((int*) arg);
-
-    while(!sorted) {
-        pthread_barrier_wait(&barrierOdd);
+void spinBarrierInit(struct spinBarrier* b, int count) {
+    b->count = count;
+    // with more threads than cpus the last thread cannot run while others spin
+    b->spin = count <= sysconf(_SC_NPROCESSORS_ONLN) ? SPIN_LIMIT : 0;
+    memset(b->words, 0, sizeof(b->words));
+    b->arrived = &b->words[0];
+    b->sleepers = &b->words[1];
+    b->reduce = &b->words[2];
+    b->generation = &b->words[padded ? CACHE_LINE_INTS : 4];
+}
 
-        pthread_barrier_wait(&barrierEven);
+// returns the OR of value over all threads of this generation
+int spinBarrierWait(struct spinBarrier* b, int value) {
+    int generation = __atomic_load_n(b->generation, __ATOMIC_ACQUIRE);
+    int* reduce = &b->reduce[generation & 1];
+    if (value) {
+        __atomic_fetch_or(reduce, value, __ATOMIC_RELAXED);
+    }
 
-        int anyChanged = 0;
-        for (int i = 0; i < t; i++) {
-            if (changed[i]) {
-                anyChanged = 1;
-                changed[i] = 0;
-            }
+    if (__atomic_add_fetch(b->arrived, 1, __ATOMIC_ACQ_REL) == b->count) {
+        // nobody enters the next generation before it is published
+        *b->arrived = 0;
+        b->reduce[(generation + 1) & 1] = 0;
+        __atomic_store_n(b->generation, generation + 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(b->sleepers, __ATOMIC_SEQ_CST) > 0) {
+            syscall(SYS_futex, b->generation, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
         }
-        if (!anyChanged) {
-            sorted = 1;
+        return *reduce;
+    }
+
+    for (int i = 0; i < b->spin; i++) {
+        if (__atomic_load_n(b->generation, __ATOMIC_ACQUIRE) != generation) {
+            return __atomic_load_n(reduce, __ATOMIC_RELAXED);
         }
+        __builtin_ia32_pause();
+    }
 
-        pthread_barrier_wait(&barrierProceed);
-        
+    __atomic_add_fetch(b->sleepers, 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(b->generation, __ATOMIC_SEQ_CST) == generation) {
+        syscall(SYS_futex, b->generation, FUTEX_WAIT_PRIVATE, generation, NULL, NULL, 0);
     }
+    __atomic_sub_fetch(b->sleepers, 1, __ATOMIC_RELAXED);
 
-    return nullptr;
+    // the slot is cleared only after this thread arrives at the next generation
+    return __atomic_load_n(reduce, __ATOMIC_RELAXED);
 }
 
-int* generate(int n) {
-    int* arr = (int*) calloc(n, sizeof(int));
+int* generate(int n, int t) {
+    int* arr = allocate(n);
+    firstTouch(arr, n, t);
     for (int i = 0; i < n; i++) {
         arr[i] = (int) rand() % (2 * n);
     }
@@ -115,39 +411,1196 @@ void print(int* arr, int n) {
     printf("\n");
 }
 
-void sort(int* arr, int n, int t) {
+int parseAlgorithm(const char* arg) {
+    for (int i = 0; i < ALGORITHM_COUNT; i++) {
+        if (strcmp(arg, algorithmNames[i]) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/*
+Times every combination of algorithm (only, or all of them when only is
+-1), n and thread count on copies of one generated array: BENCH_WARMUPS
+untimed runs, then BENCH_REPETITIONS timed ones, each checked for being
+sorted. Speedup is the median of one thread over the median of t threads.
+*/
+void benchmark(int n, int t, int only) {
+    int sizes[32];
+    int sizeCount = 0;
+    for (int m = n; sizeCount == 0 || m >= BENCH_MIN_N; m /= 10) {
+        sizes[sizeCount++] = m;
+    }
+
+    printf("n,t,algorithm,median,min,stddev,speedup\n");
+    for (int a = 0; a < ALGORITHM_COUNT; a++) {
+        if (only != -1 && a != only) {
+            continue;
+        }
+        algorithm = a;
+
+        for (int k = sizeCount - 1; k >= 0; k--) {
+            int size = sizes[k];
+            if (only == -1 && a == ALGORITHM_TRANSPOSITION && size > BENCH_TRANSPOSITION_MAX_N) {
+                continue;
+            }
+            int* source = generate(size, t);
+            int* arr = allocate(size);
+            firstTouch(arr, size, t);
+            double base = 0;
+
+            for (int threads = 1; threads <= t; threads = nextThreads(threads, t)) {
+                double times[BENCH_REPETITIONS];
+                for (int r = 0; r < BENCH_WARMUPS + BENCH_REPETITIONS; r++) {
+                    memcpy(arr, source, (size_t) size * sizeof(int));
+                    struct timespec start;
+                    clock_gettime(CLOCK_MONOTONIC, &start);
+                    sort(arr, size, threads);
+                    double time = elapsed(&start);
+
+                    if (!std::is_sorted(arr, arr + size)) {
+                        fprintf(stderr, "%s left %d elements unsorted with %d threads\n",
+                            algorithmNames[a], size, threads);
+                        exit(1);
+                    }
+                    if (r >= BENCH_WARMUPS) {
+                        times[r - BENCH_WARMUPS] = time;
+                    }
+                }
+
+                std::sort(times, times + BENCH_REPETITIONS);
+                double mean = 0;
+                for (int r = 0; r < BENCH_REPETITIONS; r++) {
+                    mean += times[r] / BENCH_REPETITIONS;
+                }
+                double variance = 0;
+                for (int r = 0; r < BENCH_REPETITIONS; r++) {
+                    variance += (times[r] - mean) * (times[r] - mean) / BENCH_REPETITIONS;
+                }
+                double median = times[BENCH_REPETITIONS / 2];
+                if (threads == 1) {
+                    base = median;
+                }
+                printf("%d,%d,%s,%.6f,%.6f,%.6f,%.2f\n", size, threads, algorithmNames[a],
+                    median, times[0], sqrt(variance), base / median);
+                fflush(stdout);
+            }
+
+            free(arr);
+            free(source);
+        }
+    }
+}
+
+// thread counts 1, 2, 4, ... and finally t itself
+int nextThreads(int threads, int t) {
+    return threads * 2 > t && threads < t ? t : threads * 2;
+}
+
+// starts worker index, pinned to the index-th allowed cpu when pinning
+void createThread(pthread_t* thread, int index, void* (*routine)(void*), void* arg) {
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+
+    cpu_set_t allowed;
+    if (pinning && sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+        int target = index % CPU_COUNT(&allowed);
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &allowed) && target-- == 0) {
+                cpu_set_t set;
+                CPU_ZERO(&set);
+                CPU_SET(cpu, &set);
+                pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+                break;
+            }
+        }
+    }
+
+    pthread_create(thread, &attr, routine, arg);
+    pthread_attr_destroy(&attr);
+}
+
+// when pinning, zeroes chunk i of arr from worker i so the pages of the
+// still untouched allocation land on the node that later sorts them
+void firstTouch(int* arr, long long n, int t) {
+    if (!pinning) {
+        return;
+    }
+
     pthread_t threads[t];
-    pthread_t controlThread;
+    struct touchParams params[t];
+    for (int i = 0; i < t; i++) {
+        params[i].arr = arr;
+        params[i].start = chunkStart(i, n, t, 1);
+        params[i].end = chunkStart(i + 1, n, t, 1);
+        createThread(&threads[i], i, evaluateTouch, &params[i]);
+    }
+    for (int i = 0; i < t; i++) {
+        pthread_join(threads[i], NULL);
+    }
+}
+
+void* evaluateTouch(void* arg) {
+    struct touchParams* p = (struct touchParams*) arg;
+    memset(p->arr + p->start, 0, (p->end - p->start) * sizeof(int));
+    return nullptr;
+}
 
-    pthread_barrier_init(&barrierOdd, NULL, t + 1);
-    pthread_barrier_init(&barrierEven, NULL, t + 1);
-    pthread_barrier_init(&barrierProceed, NULL, t + 1);
+/*
+Sorts copies of the same array with 1, 2, 4, ... t threads, once with the
+per-thread state packed as tightly as possible and once padded to cache
+lines, and prints both times and their speedup over one thread.
+*/
+void benchmarkPadding(int n, int t) {
+    int* source = generate(n, t);
+    int* arr = allocate(n);
+    firstTouch(arr, n, t);
+    double base[2];
 
-    changed = (int *)calloc(t, sizeof(int));
-    for(int i = 0; i < t; i++) {
-        changed[i] = 0;
+    printf("threads, unpadded ms, speedup, padded ms, speedup\n");
+    for (int threads = 1; threads <= t; threads = nextThreads(threads, t)) {
+        double times[2];
+        for (padded = 0; padded <= 1; padded++) {
+            memcpy(arr, source, (size_t) n * sizeof(int));
+            struct timespec start;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            sort(arr, n, threads);
+            times[padded] = elapsed(&start);
+            if (threads == 1) {
+                base[padded] = times[padded];
+            }
+        }
+        printf("%d, %.3f, %.2f, %.3f, %.2f\n", threads,
+            times[0] * 1000, base[0] / times[0], times[1] * 1000, base[1] / times[1]);
     }
 
-    int offset = 0;
+    padded = 1;
+    free(arr);
+    free(source);
+}
+
+double elapsed(struct timespec* start) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// cache line aligned array of n elements
+template <typename T>
+T* allocate(long long n) {
+    size_t size = ((size_t) n * sizeof(T) + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+    return (T*) aligned_alloc(CACHE_LINE, size > 0 ? size : CACHE_LINE);
+}
+
+// first element of chunk i when n elements are split among t threads,
+// rounded down to a multiple of align elements and, when padded and the
+// chunks are large enough not to become empty, to a cache line
+long long chunkStart(int i, long long n, int t, int align) {
+    if (i >= t) {
+        return n;
+    }
+    if (padded && n / t >= 2 * CACHE_LINE_INTS) {
+        align = std::max(align, CACHE_LINE_INTS);
+    }
+    long long start = (long long) i * n / t;
+    return start - start % align;
+}
+
+void sort(int* arr, int n, int t) {
+    selectLeaf();
+    if (algorithm == ALGORITHM_SAMPLE) {
+        sortSample(arr, n, t, std::less<int>());
+    } else if (algorithm == ALGORITHM_BLOCK) {
+        sortBlock(arr, n, t);
+    } else if (algorithm == ALGORITHM_RADIX) {
+        sortRadix(arr, n, t, [](int value) { return value; });
+    } else {
+        sortTransposition(arr, n, t);
+    }
+}
+
+void sortTransposition(int* arr, int n, int t) {
+    pthread_t threads[t];
+    struct spinBarrier barrier;
+    spinBarrierInit(&barrier, t);
+
     for (int i = 0; i < t; i++) {
-        int ti = (i + 1) * n / t - i * n / t;
+        // even offsets keep the pairs of neighbouring chunks apart
+        int offset = chunkStart(i, n, t, 2);
+        int ti = chunkStart(i + 1, n, t, 2) - offset;
         struct params* p = (struct params *)malloc(sizeof(struct params));
         p->offset = offset;
         p->count = ti;
         p->n = n;
         p->index = i;
         p->arr = arr;
+        p->barrier = &barrier;
+
+        createThread(&threads[i], i, evaluate, p);
+    }
+
+    for (int i = 0; i < t; i++) {
+        pthread_join(threads[i], NULL);
+    }
+}
+
+/*
+Parallel sample sort: t - 1 splitters are picked from a random sample,
+every thread counts and then scatters its chunk into t buckets of a
+temporary array and finally sorts one bucket and copies it back.
+Threads meet at a barrier only between the three phases. Works for any
+trivially copyable T ordered by less.
+*/
+template <typename T, typename Less>
+void sortSample(T* arr, long long n, int t, Less less) {
+    if (t <= 1 || n < 2 * t) {
+        sortBucket(arr, n, less);
+        return;
+    }
+
+    int sampleCount = t * OVERSAMPLING;
+    T* sample = (T*) malloc(sampleCount * sizeof(T));
+    for (int i = 0; i < sampleCount; i++) {
+        sample[i] = arr[((long long) rand() * RAND_MAX + rand()) % n];
+    }
+    sortBucket(sample, sampleCount, less);
+
+    sampleShared<T, Less> shared;
+    shared.arr = arr;
+    shared.tmp = allocate<T>(n);
+    shared.n = n;
+    shared.t = t;
+    shared.less = &less;
+    shared.splitters = (T*) malloc((t - 1) * sizeof(T));
+    for (int i = 1; i < t; i++) {
+        shared.splitters[i - 1] = sample[i * OVERSAMPLING];
+    }
+    // every thread increments its own row while counting
+    int perLine = CACHE_LINE / sizeof(long long);
+    shared.stride = padded ? (t + perLine - 1) / perLine * perLine : t;
+    size_t countsSize = (size_t) t * shared.stride * sizeof(long long);
+    shared.counts = (long long*) aligned_alloc(CACHE_LINE, (countsSize + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE);
+    memset(shared.counts, 0, countsSize);
+    pthread_barrier_init(&shared.barrier, NULL, t);
+
+    pthread_t threads[t];
+    sampleParams<T, Less> params[t];
+    for (int i = 0; i < t; i++) {
+        params[i].index = i;
+        params[i].shared = &shared;
+        createThread(&threads[i], i, evaluateSample<T, Less>, &params[i]);
+    }
+    for (int i = 0; i < t; i++) {
+        pthread_join(threads[i], NULL);
+    }
 
-        pthread_create(&threads[i], NULL, evaluate, p);
-        
-        offset += ti;
+    pthread_barrier_destroy(&shared.barrier);
+    free(shared.counts);
+    free(shared.splitters);
+    free(shared.tmp);
+    free(sample);
+}
+
+template <typename T, typename Less>
+void* evaluateSample(void* arg) {
+    sampleParams<T, Less> p = *((sampleParams<T, Less>*) arg);
+    sampleShared<T, Less>* s = p.shared;
+    int t = s->t;
+    T* splitterEnd = s->splitters + t - 1;
+    long long start = chunkStart(p.index, s->n, t, 1);
+    long long end = chunkStart(p.index + 1, s->n, t, 1);
+    long long* counts = s->counts + (long long) p.index * s->stride;
+
+    for (long long i = start; i < end; i++) {
+        counts[std::upper_bound(s->splitters, splitterEnd, s->arr[i], *s->less) - s->splitters]++;
+    }
+
+    pthread_barrier_wait(&s->barrier);
+
+    // bucket b starts after all smaller buckets, and within it
+    // chunk i writes after the chunks with a lower index
+    long long offsets[t];
+    long long bucketStart = 0;
+    long long ownStart = 0;
+    long long ownEnd = 0;
+    for (int b = 0; b < t; b++) {
+        long long before = 0;
+        long long total = 0;
+        for (int i = 0; i < t; i++) {
+            if (i < p.index) {
+                before += s->counts[(long long) i * s->stride + b];
+            }
+            total += s->counts[(long long) i * s->stride + b];
+        }
+        offsets[b] = bucketStart + before;
+        if (b == p.index) {
+            ownStart = bucketStart;
+            ownEnd = bucketStart + total;
+        }
+        bucketStart += total;
+    }
+
+    for (long long i = start; i < end; i++) {
+        const T& value = s->arr[i];
+        s->tmp[offsets[std::upper_bound(s->splitters, splitterEnd, value, *s->less) - s->splitters]++] = value;
+    }
+
+    pthread_barrier_wait(&s->barrier);
+
+    sortBucket(s->tmp + ownStart, ownEnd - ownStart, *s->less);
+    memcpy((void*) (s->arr + ownStart), s->tmp + ownStart, (ownEnd - ownStart) * sizeof(T));
+
+    return nullptr;
+}
+
+template <typename T, typename Less>
+void sortBucket(T* arr, long long n, Less less) {
+    std::sort(arr, arr + n, less);
+}
+
+// plain ints in ascending order get the SIMD leaf sort
+void sortBucket(int* arr, long long n, std::less<int>) {
+    localSort(arr, n);
+}
+
+/*
+Block odd-even sort: every thread sorts its own chunk, then rounds of
+odd-even transposition run over whole chunks. In a round neighbouring
+chunks are merge-split: the lower thread keeps the smallest elements of
+both, the upper thread the largest. Sorting stops once an odd and an
+even round in a row merge nothing, which takes about t rounds (chunks
+of equal size need at most t), so the threads wait on a barrier O(t)
+times instead of three times per element-level phase.
+*/
+void sortBlock(int* arr, int n, int t) {
+    if (t <= 1 || n < 2 * t) {
+        localSort(arr, n);
+        return;
+    }
+
+    struct blockShared shared;
+    shared.arr = arr;
+    shared.tmp = allocate(n);
+    shared.t = t;
+    shared.offsets = (long long*) malloc((t + 1) * sizeof(long long));
+    for (int i = 0; i <= t; i++) {
+        shared.offsets[i] = chunkStart(i, n, t, 1);
     }
-    pthread_create(&controlThread, NULL, evaluateControl, &t);
+    shared.exchanged = padded ? allocate<int>(CACHE_LINE_INTS) : shared.packedExchanged;
+    shared.exchanged[0] = shared.exchanged[1] = shared.exchanged[2] = 0;
+    pthread_barrier_init(&shared.barrier, NULL, t);
 
+    pthread_t threads[t];
+    struct blockParams params[t];
+    for (int i = 0; i < t; i++) {
+        params[i].index = i;
+        params[i].shared = &shared;
+        createThread(&threads[i], i, evaluateBlock, &params[i]);
+    }
     for (int i = 0; i < t; i++) {
         pthread_join(threads[i], NULL);
     }
-    pthread_join(controlThread, NULL);
+
+    pthread_barrier_destroy(&shared.barrier);
+    if (padded) {
+        free(shared.exchanged);
+    }
+    free(shared.offsets);
+    free(shared.tmp);
+}
+
+void* evaluateBlock(void* arg) {
+    struct blockParams p = *((struct blockParams*) arg);
+    struct blockShared* s = p.shared;
+    long long* offsets = s->offsets;
+    int i = p.index;
+    long long count = offsets[i + 1] - offsets[i];
+
+    localSort(s->arr + offsets[i], count);
+    pthread_barrier_wait(&s->barrier);
+
+    for (int round = 0; ; round++) {
+        // partner is the neighbour this thread is paired with in this round
+        int partner = (i % 2 == round % 2) ? i + 1 : i - 1;
+        int exchange = partner >= 0 && partner < s->t;
+        int lower = partner > i ? i : partner;
+
+        // blocks already in order need no merge
+        if (exchange && s->arr[offsets[lower + 1] - 1] <= s->arr[offsets[lower + 1]]) {
+            exchange = 0;
+        }
+
+        if (exchange) {
+            __atomic_store_n(&s->exchanged[round % 3], 1, __ATOMIC_RELAXED);
+            int* a = s->arr + offsets[lower];
+            long long countA = offsets[lower + 1] - offsets[lower];
+            int* b = s->arr + offsets[lower + 1];
+            long long countB = offsets[lower + 2] - offsets[lower + 1];
+            if (lower == i) {
+                mergeLow(a, countA, b, countB, s->tmp + offsets[i], count);
+            } else {
+                mergeHigh(a, countA, b, countB, s->tmp + offsets[i], count);
+            }
+        }
+        pthread_barrier_wait(&s->barrier);
+
+        // every thread has read the flag of round - 2 by now, so it can be reused
+        if (i == 0) {
+            s->exchanged[(round + 1) % 3] = 0;
+        }
+        if (exchange) {
+            memcpy(s->arr + offsets[i], s->tmp + offsets[i], count * sizeof(int));
+        }
+        pthread_barrier_wait(&s->barrier);
+
+        if (round > 0 && !s->exchanged[round % 3] && !s->exchanged[(round + 2) % 3]) {
+            break;
+        }
+    }
+
+    return nullptr;
+}
+
+/*
+Parallel LSD radix sort by the integral key(element): keys are taken
+relative to the smallest one, so the [0, 2n) values from generate() need
+only log2(2n) bits, which are split into as few digits of at most
+RADIX_BITS bits as possible. In every pass each thread counts the digits
+of its chunk, then scatters the chunk stably into the other array at
+offsets from a prefix sum over all histograms, so a pass costs two
+barriers and O(n / t + 2^bits * t) work.
+*/
+template <typename T, typename Key>
+void sortRadix(T* arr, long long n, int t, Key key) {
+    typedef radixKey<T, Key> U;
+    if (n < 2) {
+        return;
+    }
+    if (t > n) {
+        t = n;
+    }
+
+    radixShared<T, Key> shared;
+    shared.arr = arr;
+    shared.tmp = allocate<T>(n);
+    shared.n = n;
+    shared.t = t;
+    shared.key = &key;
+    shared.low = (U*) malloc(t * sizeof(U));
+    shared.high = (U*) malloc(t * sizeof(U));
+    // padded histogram rows are whole cache lines, so aligning the base pads them
+    shared.counts = (long long*) aligned_alloc(CACHE_LINE, (size_t) t * RADIX_BUCKETS * sizeof(long long));
+    pthread_barrier_init(&shared.barrier, NULL, t);
+
+    pthread_t threads[t];
+    radixParams<T, Key> params[t];
+    for (int i = 0; i < t; i++) {
+        params[i].index = i;
+        params[i].shared = &shared;
+        createThread(&threads[i], i, evaluateRadix<T, Key>, &params[i]);
+    }
+    for (int i = 0; i < t; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    pthread_barrier_destroy(&shared.barrier);
+    free(shared.counts);
+    free(shared.high);
+    free(shared.low);
+    free(shared.tmp);
+}
+
+template <typename T, typename Key>
+void* evaluateRadix(void* arg) {
+    typedef radixKey<T, Key> U;
+    radixParams<T, Key> p = *((radixParams<T, Key>*) arg);
+    radixShared<T, Key>* s = p.shared;
+    int t = s->t;
+    long long start = chunkStart(p.index, s->n, t, 1);
+    long long end = chunkStart(p.index + 1, s->n, t, 1);
+
+    U low = std::numeric_limits<U>::max();
+    U high = 0;
+    for (long long i = start; i < end; i++) {
+        U value = orderedKey((*s->key)(s->arr[i]));
+        low = std::min(low, value);
+        high = std::max(high, value);
+    }
+    s->low[p.index] = low;
+    s->high[p.index] = high;
+
+    pthread_barrier_wait(&s->barrier);
+
+    // every thread derives the same digit layout from the key range
+    for (int i = 0; i < t; i++) {
+        low = std::min(low, s->low[i]);
+        high = std::max(high, s->high[i]);
+    }
+    U range = high - low;
+    int bits = 0;
+    while (bits < (int) sizeof(U) * 8 && (range >> bits) != 0) {
+        bits++;
+    }
+    int passes = (bits + RADIX_BITS - 1) / RADIX_BITS;
+    int digitBits = passes > 0 ? (bits + passes - 1) / passes : 0;
+    int buckets = 1 << digitBits;
+    U mask = buckets - 1;
+    // unpadded rows hold only the digits in use, so neighbouring rows share lines
+    long long stride = padded ? RADIX_BUCKETS : buckets;
+    long long* counts = s->counts + p.index * stride;
+
+    T* src = s->arr;
+    T* dst = s->tmp;
+    long long offsets[RADIX_BUCKETS];
+    for (int pass = 0; pass < passes; pass++) {
+        int shift = pass * digitBits;
+        memset(counts, 0, buckets * sizeof(long long));
+        for (long long i = start; i < end; i++) {
+            counts[((U) (orderedKey((*s->key)(src[i])) - low) >> shift) & mask]++;
+        }
+
+        pthread_barrier_wait(&s->barrier);
+
+        // digit d starts after all smaller digits, and within it
+        // chunk i writes after the chunks with a lower index
+        long long before = 0;
+        for (int d = 0; d < buckets; d++) {
+            for (int i = 0; i < t; i++) {
+                if (i == p.index) {
+                    offsets[d] = before;
+                }
+                before += s->counts[i * stride + d];
+            }
+        }
+        for (long long i = start; i < end; i++) {
+            const T& value = src[i];
+            dst[offsets[((U) (orderedKey((*s->key)(value)) - low) >> shift) & mask]++] = value;
+        }
+
+        // histograms are reset only after every thread has read them
+        pthread_barrier_wait(&s->barrier);
+
+        std::swap(src, dst);
+    }
+
+    if (src != s->arr) {
+        memcpy((void*) (s->arr + start), src + start, (end - start) * sizeof(T));
+    }
+
+    return nullptr;
+}
+
+// flipping the sign bit orders negative keys before the positive ones
+template <typename K>
+typename std::make_unsigned<K>::type orderedKey(K key) {
+    typedef typename std::make_unsigned<K>::type U;
+    if (std::is_signed<K>::value) {
+        return (U) key ^ (U) ((U) 1 << (sizeof(K) * 8 - 1));
+    }
+    return (U) key;
+}
+
+// generic entry point, sorts any trivially copyable T by less with the sample sort engine
+template <typename T, typename Less>
+void sortBy(T* arr, long long n, int t, Less less) {
+    selectLeaf();
+    sortSample(arr, n, t, less);
+}
+
+// sorts records by key with less, integral keys in the default ascending
+// order take the stable radix fast path
+template <typename K, typename V, typename Less>
+void sortRecords(record<K, V>* arr, long long n, int t, Less less) {
+    if constexpr (std::is_integral<K>::value && std::is_same<Less, std::less<K>>::value) {
+        sortRadix(arr, n, t, [](const record<K, V>& r) { return r.key; });
+    } else {
+        sortBy(arr, n, t, [&less](const record<K, V>& a, const record<K, V>& b) { return less(a.key, b.key); });
+    }
+}
+
+/*
+Sorts n (64-bit key, int payload) records by key with the radix fast path
+and with the comparison sort, checking that every payload stayed with its
+key. The payload is the original index, so the keys can be looked up.
+*/
+void benchmarkRecords(int n, int t) {
+    record<long long, int>* source = allocate<record<long long, int>>(n);
+    record<long long, int>* arr = allocate<record<long long, int>>(n);
+    for (int i = 0; i < n; i++) {
+        source[i].key = ((long long) rand() << 31 | rand()) - ((long long) RAND_MAX << 30);
+        source[i].value = i;
+    }
+
+    for (int radix = 1; radix >= 0; radix--) {
+        memcpy(arr, source, (size_t) n * sizeof(record<long long, int>));
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (radix) {
+            sortRecords(arr, n, t);
+        } else {
+            sortBy(arr, n, t, [](const record<long long, int>& a, const record<long long, int>& b) {
+                return a.key < b.key;
+            });
+        }
+        double time = elapsed(&start);
+
+        int valid = 1;
+        for (int i = 0; i < n; i++) {
+            if (arr[i].key != source[arr[i].value].key || (i > 0 && arr[i - 1].key > arr[i].key)) {
+                valid = 0;
+                break;
+            }
+        }
+        printf("%s sort of %d records took %.3f seconds%s.\n", radix ? "Radix" : "Comparison", n, time,
+            valid ? "" : ", RESULT IS WRONG");
+    }
+
+    free(arr);
+    free(source);
+}
+
+/*
+External sort: the input is read in runs of runSize ints, each run is
+sorted in memory by the selected algorithm and appended to a temporary
+run file, and then all runs are merged into the output with a loser tree.
+Reading the next run overlaps sorting the current one, and every merge
+input as well as the output has two buffers, so the disk works while the
+threads sort or merge. All I/O goes through a single I/O thread in large
+sequential blocks.
+*/
+int sortExternal(const char* input, const char* output, long long runSize, int t) {
+    int inputFd = open(input, O_RDONLY);
+    if (inputFd < 0) {
+        perror(input);
+        return 1;
+    }
+    int outputFd = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (outputFd < 0) {
+        perror(output);
+        close(inputFd);
+        return 1;
+    }
+    char runPath[4096];
+    snprintf(runPath, sizeof(runPath), "%s.XXXXXX", output);
+    int runFd = mkstemp(runPath);
+    if (runFd < 0) {
+        perror(runPath);
+        close(outputFd);
+        close(inputFd);
+        return 1;
+    }
+    // the runs disappear with the descriptor, even if the sort is interrupted
+    unlink(runPath);
+
+    off_t size = lseek(inputFd, 0, SEEK_END);
+    long long total = size / sizeof(int);
+    if (runSize < 1) {
+        runSize = 1;
+    }
+    int k = (int) ((total + runSize - 1) / runSize);
+
+    struct ioQueue io;
+    ioStart(&io, 2 * k + 4);
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    selectLeaf();
+
+    // run generation, while run r is sorted run r + 1 is read into the other buffer
+    int* runs[2] = {allocate(runSize), allocate(runSize)};
+    int readReady[2] = {1, 1};
+    int writeReady[2] = {1, 1};
+    if (k > 0) {
+        readReady[0] = 0;
+        ioSubmit(&io, 0, inputFd, runs[0], std::min(runSize, total), 0, &readReady[0]);
+    }
+    for (int r = 0; r < k; r++) {
+        int b = r % 2;
+        long long offset = r * runSize;
+        long long count = std::min(runSize, total - offset);
+        if (r + 1 < k) {
+            long long nextOffset = offset + runSize;
+            ioWait(&io, &writeReady[1 - b]);
+            readReady[1 - b] = 0;
+            ioSubmit(&io, 0, inputFd, runs[1 - b], std::min(runSize, total - nextOffset),
+                nextOffset * sizeof(int), &readReady[1 - b]);
+        }
+        ioWait(&io, &readReady[b]);
+        sort(runs[b], (int) count, t);
+        writeReady[b] = 0;
+        ioSubmit(&io, 1, runFd, runs[b], count, offset * sizeof(int), &writeReady[b]);
+    }
+    ioWait(&io, &writeReady[0]);
+    ioWait(&io, &writeReady[1]);
+    free(runs[0]);
+    free(runs[1]);
+    double runTime = elapsed(&start);
+
+    // merge, the memory of the two run buffers is split among the streams
+    long long block = std::max(runSize / (k + 1), (long long) EXTERNAL_MIN_BLOCK);
+    struct runReader* readers = (struct runReader*) malloc((k + 1) * sizeof(struct runReader));
+    for (int i = 0; i < k; i++) {
+        struct runReader* r = &readers[i];
+        r->next = (off_t) i * runSize * sizeof(int);
+        r->end = (off_t) std::min((i + 1) * runSize, total) * sizeof(int);
+        r->buffers[0] = allocate(block);
+        r->buffers[1] = allocate(block);
+        readerRequest(&io, runFd, r, 0, block);
+        readerRequest(&io, runFd, r, 1, block);
+        r->current = 0;
+        r->position = 0;
+        ioWait(&io, &r->ready[0]);
+        r->done = r->counts[0] == 0;
+    }
+
+    int* losers = (int*) malloc((k + 1) * sizeof(int));
+    int winner = k > 1 ? loserBuild(readers, losers, k, 1) : 0;
+    int* out[2] = {allocate(block), allocate(block)};
+    int outReady[2] = {1, 1};
+    int current = 0;
+    long long filled = 0;
+    off_t written = 0;
+    for (long long i = 0; i < total; i++) {
+        struct runReader* r = &readers[winner];
+        out[current][filled++] = r->buffers[r->current][r->position];
+        readerAdvance(&io, runFd, r, block);
+
+        // the winner's path to the root is the only one that changed
+        for (int node = (winner + k) / 2; node >= 1; node /= 2) {
+            if (loserBeats(readers, losers[node], winner)) {
+                std::swap(losers[node], winner);
+            }
+        }
+
+        if (filled == block || i == total - 1) {
+            outReady[current] = 0;
+            ioSubmit(&io, 1, outputFd, out[current], filled, written, &outReady[current]);
+            written += filled * sizeof(int);
+            current = 1 - current;
+            ioWait(&io, &outReady[current]);
+            filled = 0;
+        }
+    }
+    ioWait(&io, &outReady[0]);
+    ioWait(&io, &outReady[1]);
+    ioStop(&io);
+
+    printf("Sorted %lld ints in %d runs: runs took %.3f seconds, merge %.3f seconds.\n",
+        total, k, runTime, elapsed(&start) - runTime);
+
+    for (int i = 0; i < k; i++) {
+        free(readers[i].buffers[0]);
+        free(readers[i].buffers[1]);
+    }
+    free(readers);
+    free(losers);
+    free(out[0]);
+    free(out[1]);
+    close(runFd);
+    close(outputFd);
+    close(inputFd);
+    return 0;
+}
+
+void ioStart(struct ioQueue* q, int capacity) {
+    q->requests = (struct ioRequest*) malloc(capacity * sizeof(struct ioRequest));
+    q->capacity = capacity;
+    q->head = 0;
+    q->tail = 0;
+    q->stop = 0;
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->submitted, NULL);
+    pthread_cond_init(&q->completed, NULL);
+    pthread_create(&q->thread, NULL, evaluateIo, q);
+}
+
+// every caller keeps at most two requests per stream in flight, so the
+// queue never holds more than capacity of them
+void ioSubmit(struct ioQueue* q, int write, int fd, int* buffer, long long count, off_t offset, int* ready) {
+    pthread_mutex_lock(&q->lock);
+    struct ioRequest* request = &q->requests[q->tail % q->capacity];
+    request->write = write;
+    request->fd = fd;
+    request->buffer = buffer;
+    request->count = count;
+    request->offset = offset;
+    request->ready = ready;
+    q->tail++;
+    pthread_cond_signal(&q->submitted);
+    pthread_mutex_unlock(&q->lock);
+}
+
+void ioWait(struct ioQueue* q, int* ready) {
+    pthread_mutex_lock(&q->lock);
+    while (!*ready) {
+        pthread_cond_wait(&q->completed, &q->lock);
+    }
+    pthread_mutex_unlock(&q->lock);
+}
+
+void ioStop(struct ioQueue* q) {
+    pthread_mutex_lock(&q->lock);
+    q->stop = 1;
+    pthread_cond_signal(&q->submitted);
+    pthread_mutex_unlock(&q->lock);
+    pthread_join(q->thread, NULL);
+    pthread_cond_destroy(&q->completed);
+    pthread_cond_destroy(&q->submitted);
+    pthread_mutex_destroy(&q->lock);
+    free(q->requests);
+}
+
+void* evaluateIo(void* arg) {
+    struct ioQueue* q = (struct ioQueue*) arg;
+
+    pthread_mutex_lock(&q->lock);
+    while (1) {
+        while (q->head == q->tail && !q->stop) {
+            pthread_cond_wait(&q->submitted, &q->lock);
+        }
+        if (q->head == q->tail) {
+            break;
+        }
+        struct ioRequest request = q->requests[q->head % q->capacity];
+        q->head++;
+        pthread_mutex_unlock(&q->lock);
+
+        char* data = (char*) request.buffer;
+        size_t left = request.count * sizeof(int);
+        off_t offset = request.offset;
+        while (left > 0) {
+            ssize_t done = request.write
+                ? pwrite(request.fd, data, left, offset)
+                : pread(request.fd, data, left, offset);
+            if (done <= 0) {
+                perror(request.write ? "pwrite" : "pread");
+                exit(1);
+            }
+            data += done;
+            left -= done;
+            offset += done;
+        }
+
+        pthread_mutex_lock(&q->lock);
+        *request.ready = 1;
+        pthread_cond_broadcast(&q->completed);
+    }
+    pthread_mutex_unlock(&q->lock);
+
+    return nullptr;
+}
+
+// refills buffer b of the run with its next block, an empty block marks the end
+void readerRequest(struct ioQueue* q, int fd, struct runReader* r, int b, long long block) {
+    long long count = std::min(block, (long long) (r->end - r->next) / (long long) sizeof(int));
+    r->counts[b] = count;
+    if (count == 0) {
+        r->ready[b] = 1;
+        return;
+    }
+    r->ready[b] = 0;
+    ioSubmit(q, 0, fd, r->buffers[b], count, r->next, &r->ready[b]);
+    r->next += count * sizeof(int);
+}
+
+void readerAdvance(struct ioQueue* q, int fd, struct runReader* r, long long block) {
+    if (++r->position < r->counts[r->current]) {
+        return;
+    }
+    readerRequest(q, fd, r, r->current, block);
+    r->current = 1 - r->current;
+    r->position = 0;
+    ioWait(q, &r->ready[r->current]);
+    r->done = r->counts[r->current] == 0;
+}
+
+// whether the head of run a goes out before the head of run b
+int loserBeats(struct runReader* readers, int a, int b) {
+    if (readers[b].done) {
+        return 1;
+    }
+    if (readers[a].done) {
+        return 0;
+    }
+    return readers[a].buffers[readers[a].current][readers[a].position]
+        <= readers[b].buffers[readers[b].current][readers[b].position];
+}
+
+// node n has children 2n and 2n + 1 and run i is leaf k + i, so internal
+// nodes 1 .. k - 1 keep the loser of their match and the winner is returned
+int loserBuild(struct runReader* readers, int* losers, int k, int node) {
+    if (node >= k) {
+        return node - k;
+    }
+    int left = loserBuild(readers, losers, k, 2 * node);
+    int right = loserBuild(readers, losers, k, 2 * node + 1);
+    if (loserBeats(readers, left, right)) {
+        losers[node] = right;
+        return left;
+    }
+    losers[node] = left;
+    return right;
+}
+
+// writes the count smallest elements of sorted a and b to out
+void mergeLow(int* a, long long countA, int* b, long long countB, int* out, long long count) {
+    long long i = 0;
+    long long j = 0;
+    for (long long k = 0; k < count; k++) {
+        if (j >= countB || (i < countA && a[i] <= b[j])) {
+            out[k] = a[i++];
+        } else {
+            out[k] = b[j++];
+        }
+    }
+}
+
+// writes the count largest elements of sorted a and b to out
+void mergeHigh(int* a, long long countA, int* b, long long countB, int* out, long long count) {
+    long long i = countA - 1;
+    long long j = countB - 1;
+    for (long long k = count - 1; k >= 0; k--) {
+        if (i < 0 || (j >= 0 && b[j] >= a[i])) {
+            out[k] = b[j--];
+        } else {
+            out[k] = a[i--];
+        }
+    }
+}
+
+/*
+Sequential sort used by the parallel engines for their chunks and buckets:
+quicksort down to ranges of LEAF_SIZE elements, which are finished by a
+bitonic sorting network in AVX-512 or AVX2 registers when the CPU has them.
+*/
+void localSort(int* arr, long long n) {
+    int depth = 0;
+    for (long long m = n; m > 1; m /= 2) {
+        depth += 2;
+    }
+    quickSort(arr, n, depth);
+}
+
+// falls back to std::sort once the recursion gets too deep
+void quickSort(int* arr, long long n, int depth) {
+    while (n > LEAF_SIZE) {
+        if (depth-- == 0) {
+            std::sort(arr, arr + n);
+            return;
+        }
+
+        int a = arr[0];
+        int b = arr[n / 2];
+        int c = arr[n - 1];
+        int pivot = std::max(std::min(a, b), std::min(std::max(a, b), c));
+        long long i = -1;
+        long long j = n;
+        while (1) {
+            do {
+                i++;
+            } while (arr[i] < pivot);
+            do {
+                j--;
+            } while (arr[j] > pivot);
+            if (i >= j) {
+                break;
+            }
+            std::swap(arr[i], arr[j]);
+        }
+
+        // [0, j] <= pivot <= [j + 1, n), recurse into the smaller part
+        if (j + 1 < n - j - 1) {
+            quickSort(arr, j + 1, depth);
+            arr += j + 1;
+            n -= j + 1;
+        } else {
+            quickSort(arr + j + 1, n - j - 1, depth);
+            n = j + 1;
+        }
+    }
+    sortLeaf(arr, (int) n);
+}
+
+void selectLeaf() {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        sortLeaf = sortLeafAvx512;
+    } else if (__builtin_cpu_supports("avx2")) {
+        sortLeaf = sortLeafAvx2;
+    } else {
+        sortLeaf = sortLeafScalar;
+    }
+}
+
+void sortLeafScalar(int* arr, int n) {
+    for (int i = 1; i < n; i++) {
+        int value = arr[i];
+        int j = i - 1;
+        while (j >= 0 && arr[j] > value) {
+            arr[j + 1] = arr[j];
+            j--;
+        }
+        arr[j + 1] = value;
+    }
+}
+
+// one layer of a bitonic network: lane i is compared with lane i ^ j and
+// keeps the larger value when its bits j and k differ, so k = 0 sorts
+// ascending and k = 2j sorts pairs of j lanes in alternating directions
+__attribute__((target("avx2")))
+static inline __m256i bitonicExchange8(__m256i v, int k, int j) {
+    __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    __m256i zero = _mm256_setzero_si256();
+    __m256i other = _mm256_permutevar8x32_epi32(v, _mm256_xor_si256(lanes, _mm256_set1_epi32(j)));
+    __m256i high = _mm256_xor_si256(
+        _mm256_cmpgt_epi32(_mm256_and_si256(lanes, _mm256_set1_epi32(j)), zero),
+        _mm256_cmpgt_epi32(_mm256_and_si256(lanes, _mm256_set1_epi32(k)), zero));
+    return _mm256_blendv_epi8(_mm256_min_epi32(v, other), _mm256_max_epi32(v, other), high);
+}
+
+// sorts a bitonic register
+__attribute__((target("avx2")))
+static inline __m256i bitonicMerge8(__m256i v) {
+    v = bitonicExchange8(v, 0, 4);
+    v = bitonicExchange8(v, 0, 2);
+    return bitonicExchange8(v, 0, 1);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i bitonicSort8(__m256i v) {
+    v = bitonicExchange8(v, 2, 1);
+    v = bitonicExchange8(v, 4, 2);
+    v = bitonicExchange8(v, 4, 1);
+    return bitonicMerge8(v);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i reverse8(__m256i v) {
+    return _mm256_permutevar8x32_epi32(v, _mm256_setr_epi32(7, 6, 5, 4, 3, 2, 1, 0));
+}
+
+// sorts the bitonic sequence of 16 held in a and b
+__attribute__((target("avx2")))
+static inline void bitonicMerge16Avx2(__m256i* a, __m256i* b) {
+    __m256i low = _mm256_min_epi32(*a, *b);
+    __m256i high = _mm256_max_epi32(*a, *b);
+    *a = bitonicMerge8(low);
+    *b = bitonicMerge8(high);
+}
+
+__attribute__((target("avx2")))
+static inline void bitonicSort16Avx2(__m256i* a, __m256i* b) {
+    *a = bitonicSort8(*a);
+    *b = reverse8(bitonicSort8(*b));
+    bitonicMerge16Avx2(a, b);
+}
+
+__attribute__((target("avx2")))
+static inline void bitonicSort32Avx2(__m256i* v) {
+    bitonicSort16Avx2(&v[0], &v[1]);
+    bitonicSort16Avx2(&v[2], &v[3]);
+
+    // ascending lower half followed by the reversed upper half is bitonic
+    __m256i upper0 = reverse8(v[3]);
+    __m256i upper1 = reverse8(v[2]);
+    __m256i low0 = _mm256_min_epi32(v[0], upper0);
+    __m256i low1 = _mm256_min_epi32(v[1], upper1);
+    __m256i high0 = _mm256_max_epi32(v[0], upper0);
+    __m256i high1 = _mm256_max_epi32(v[1], upper1);
+    bitonicMerge16Avx2(&low0, &low1);
+    bitonicMerge16Avx2(&high0, &high1);
+    v[0] = low0;
+    v[1] = low1;
+    v[2] = high0;
+    v[3] = high1;
+}
+
+// pads the range with INT_MAX up to the next network size
+__attribute__((target("avx2")))
+void sortLeafAvx2(int* arr, int n) {
+    if (n < 2) {
+        return;
+    }
+    int size = n <= 8 ? 8 : n <= 16 ? 16 : LEAF_SIZE;
+    int buffer[LEAF_SIZE];
+    memcpy(buffer, arr, n * sizeof(int));
+    for (int i = n; i < size; i++) {
+        buffer[i] = INT_MAX;
+    }
+
+    __m256i v[LEAF_SIZE / 8];
+    for (int i = 0; i < size / 8; i++) {
+        v[i] = _mm256_loadu_si256((__m256i*) (buffer + 8 * i));
+    }
+    if (size == 8) {
+        v[0] = bitonicSort8(v[0]);
+    } else if (size == 16) {
+        bitonicSort16Avx2(&v[0], &v[1]);
+    } else {
+        bitonicSort32Avx2(v);
+    }
+    for (int i = 0; i < size / 8; i++) {
+        _mm256_storeu_si256((__m256i*) (buffer + 8 * i), v[i]);
+    }
+    memcpy(arr, buffer, n * sizeof(int));
+}
+
+// same as bitonicExchange8 on 16 lanes; the maskz forms with a full mask
+// keep GCC from warning about the undefined passthrough of the plain ones
+__attribute__((target("avx512f")))
+static inline __m512i bitonicExchange16(__m512i v, int k, int j) {
+    __m512i lanes = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    __m512i other = _mm512_maskz_permutexvar_epi32((__mmask16) -1,
+        _mm512_xor_si512(lanes, _mm512_set1_epi32(j)), v);
+    __mmask16 high = _mm512_test_epi32_mask(lanes, _mm512_set1_epi32(j))
+        ^ _mm512_test_epi32_mask(lanes, _mm512_set1_epi32(k));
+    return _mm512_mask_blend_epi32(high, _mm512_maskz_min_epi32((__mmask16) -1, v, other),
+        _mm512_maskz_max_epi32((__mmask16) -1, v, other));
+}
+
+__attribute__((target("avx512f")))
+static inline __m512i bitonicMerge16(__m512i v) {
+    v = bitonicExchange16(v, 0, 8);
+    v = bitonicExchange16(v, 0, 4);
+    v = bitonicExchange16(v, 0, 2);
+    return bitonicExchange16(v, 0, 1);
+}
+
+__attribute__((target("avx512f")))
+static inline __m512i bitonicSort16(__m512i v) {
+    v = bitonicExchange16(v, 2, 1);
+    v = bitonicExchange16(v, 4, 2);
+    v = bitonicExchange16(v, 4, 1);
+    v = bitonicExchange16(v, 8, 4);
+    v = bitonicExchange16(v, 8, 2);
+    v = bitonicExchange16(v, 8, 1);
+    return bitonicMerge16(v);
+}
+
+// masked loads pad the range with INT_MAX up to the next network size
+__attribute__((target("avx512f")))
+void sortLeafAvx512(int* arr, int n) {
+    if (n < 2) {
+        return;
+    }
+    __m512i padding = _mm512_set1_epi32(INT_MAX);
+    if (n <= 16) {
+        __mmask16 mask = (__mmask16) ((1u << n) - 1);
+        __m512i v = bitonicSort16(_mm512_mask_loadu_epi32(padding, mask, arr));
+        _mm512_mask_storeu_epi32(arr, mask, v);
+        return;
+    }
+
+    __mmask16 mask = (__mmask16) ((1u << (n - 16)) - 1);
+    __m512i a = bitonicSort16(_mm512_loadu_si512(arr));
+    __m512i b = bitonicSort16(_mm512_mask_loadu_epi32(padding, mask, arr + 16));
+    __m512i reversed = _mm512_maskz_permutexvar_epi32((__mmask16) -1,
+        _mm512_setr_epi32(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0), b);
+    __m512i low = bitonicMerge16(_mm512_maskz_min_epi32((__mmask16) -1, a, reversed));
+    __m512i high = bitonicMerge16(_mm512_maskz_max_epi32((__mmask16) -1, a, reversed));
+    _mm512_storeu_si512(arr, low);
+    _mm512_mask_storeu_epi32(arr + 16, mask, high);
 }
 
 int step(int* arr, int n, int offset, int count) {
@@ -1,29 +1,117 @@
-﻿#include <stdio.h>
+﻿#define _GNU_SOURCE
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <limits.h>
 #include <math.h>
+#include <sched.h>
 #include <omp.h>
 
 #define DEFAULT_N 1000000;
 #define DEFAULT_T 1;
 
-int getDivisorSum(int n);
+#define MODE_TRIAL 0
+#define MODE_SIEVE 1
+#define MODE_SEGMENT 2
+#define MODE_BEYOND 3
+#define MODE_FUSED 4
 
-// command: ./n4 <n> <t>
+// numbers sieved at once by one thread, 256 KB of sums fits in L2
+#define SIEVE_BLOCK 65536
+
+// candidates the fused check prefetches ahead
+#define FUSED_PREFETCH 16
+
+// numbers per segment of the segmented sieve, its 20 bytes per number fit in L2;
+// above n = SEGMENT_SIZE^2 segments grow to sqrt(n) so that sieving a
+// segment is not dominated by walking the prime table
+#define SEGMENT_SIZE 16384
+
+// s(m) < PARTNER_LIMIT * m for every m up to 10^12, which bounds the
+// partners the beyond mode has to factorise
+#define PARTNER_LIMIT 8
+
+// an odd prime with its inverse modulo 2^64 and the largest quotient by it:
+// m is divisible by prime exactly when m * inverse <= limit (mod 2^64),
+// and m * inverse is then m / prime
+struct divisor {
+    unsigned long prime;
+    unsigned long inverse;
+    unsigned long limit;
+};
+
+long getDivisorSum(long n, struct divisor* divisors, int divisorCount);
+struct divisor* getDivisors(long limit, int* count);
+long takePower(unsigned long* m, struct divisor* d);
+int saturate(long sum);
+void sieveDivisorSums(int* numbers, int n);
+void sieveBlock(long* sums, long low, long high);
+long getFusedAmicableSum(int n, int pin);
+long getSegmentedAmicableSum(long n, int pin, int beyond);
+void sieveSegment(long low, long high, int* primes, int primeCount, long* sigma, long* factored, int* marks);
+int hasSigma(long n, long target, struct divisor* divisors, int divisorCount);
+int* getPrimes(int limit, int* count);
+int parseMode(const char* arg);
+void pinThread(int index);
+
+// command: ./n4 <n> <t> [mode] [pin]
 // n - range [1, n] will be used for processing
 // t - number of threads
+// mode - trial (trial division of every number, default), sieve (divisor sum sieve)
+//        segment (segmented sieve that checks pairs on the fly in O(sqrt(n)) memory, n up to 10^12)
+//        beyond (segment, also counting pairs whose larger number is above n)
+//        or fused (sieve that checks pairs while each block is in cache, no second pass)
+// pin - optional, pins thread i to the i-th allowed cpu and has every thread
+//       first touch the part of numbers it later checks, so it is local memory
 int main(int argc, char **argv) {
-    int n = DEFAULT_N;
+    long n = DEFAULT_N;
     int t = DEFAULT_T;
+    int mode = MODE_TRIAL;
+    int pin = 0;
+    if (argc >= 4 && strcmp(argv[argc - 1], "pin") == 0) {
+        pin = 1;
+        argc--;
+    }
     if (argc >= 2) {
-        n = atoi(argv[1]);
+        n = atol(argv[1]);
     }
     if (argc >= 3) {
         t = atoi(argv[2]);
     }
+    if (argc >= 4) {
+        mode = parseMode(argv[3]);
+        if (mode == -1) {
+            printf("Unknown mode: %s\n", argv[3]);
+            return 1;
+        }
+    }
+
+    if (mode == MODE_SEGMENT || mode == MODE_BEYOND) {
+        omp_set_num_threads(t);
+        double start = omp_get_wtime();
+        long sum = getSegmentedAmicableSum(n, pin, mode == MODE_BEYOND);
+        printf("Done.\nSum: %ld.\nProgram took %f seconds.\n", sum, omp_get_wtime() - start);
+        return 0;
+    }
+    if (n >= INT_MAX) {
+        printf("n = %ld does not fit the numbers array, use the segment mode.\n", n);
+        return 1;
+    }
+    if (mode == MODE_FUSED) {
+        omp_set_num_threads(t);
+        double start = omp_get_wtime();
+        long sum = getFusedAmicableSum(n, pin);
+        printf("Done.\nSum: %ld.\nProgram took %f seconds.\n", sum, omp_get_wtime() - start);
+        return 0;
+    }
 
 
     // since we skip 0, we shift index access by -1
-    int* numbers = calloc(n, sizeof(int));
+    // malloc leaves large arrays untouched, so the pages are placed on the
+    // node of the thread that first writes them
+    int* numbers = malloc(n * sizeof(int));
+    int divisorCount = 0;
+    struct divisor* divisors = mode == MODE_TRIAL ? getDivisors(n, &divisorCount) : NULL;
     long sum = 0;
     int divisorSum;
     double start, half, end;
@@ -31,10 +119,24 @@ int main(int argc, char **argv) {
     omp_set_num_threads(t);
     #pragma omp parallel
     {
-        start = omp_get_wtime();
-        #pragma omp for schedule(dynamic, 1000)
+        if (pin) {
+            pinThread(omp_get_thread_num());
+        }
+
+        // same static partition as the check loop below
+        #pragma omp for
         for (int i = 1; i <= n; i++) {
-            numbers[i - 1] = getDivisorSum(i);
+            numbers[i - 1] = 0;
+        }
+
+        start = omp_get_wtime();
+        if (mode == MODE_SIEVE) {
+            sieveDivisorSums(numbers, n);
+        } else {
+            #pragma omp for schedule(dynamic, 1000)
+            for (int i = 1; i <= n; i++) {
+                numbers[i - 1] = saturate(getDivisorSum(i, divisors, divisorCount));
+            }
         }
 
         half = omp_get_wtime();
@@ -53,25 +155,438 @@ int main(int argc, char **argv) {
 
     printf("Done.\nSum: %ld.\nGenerating divisor sums took %f seconds.\nGenerating final sum took %f seconds.\nProgram took %f seconds.\n", sum, half - start, end - half, end - start);
 
+    free(divisors);
     free(numbers);
     return 0;
 }
 
-int getDivisorSum(int n) {
-    int sum = 1;
-    for (int i = 2; i <= sqrt(n); i++) {
-        if (n % i == 0) {
-            sum += i;
+int parseMode(const char* arg) {
+    if (strcmp(arg, "trial") == 0) {
+        return MODE_TRIAL;
+    }
+    if (strcmp(arg, "sieve") == 0) {
+        return MODE_SIEVE;
+    }
+    if (strcmp(arg, "segment") == 0) {
+        return MODE_SEGMENT;
+    }
+    if (strcmp(arg, "beyond") == 0) {
+        return MODE_BEYOND;
+    }
+    if (strcmp(arg, "fused") == 0) {
+        return MODE_FUSED;
+    }
+    return -1;
+}
+
+// Stores the same sums in numbers as getDivisorSum: every divisor
+// pair d * k = m with d <= k adds d and k, except for d = 1 where k = m
+// itself is left out, so 1 gets 0. Only d <= sqrt(m) is visited, so the whole range
+// costs O(n log n) additions. Threads take SIEVE_BLOCK sized blocks of m
+// and add up a block in their own 64-bit buffer, which stays in cache, so
+// only the finished and saturated sums are written to numbers.
+// Called from inside the parallel region.
+void sieveDivisorSums(int* numbers, int n) {
+    int blocks = ((long) n + SIEVE_BLOCK - 1) / SIEVE_BLOCK;
+    long* sums = malloc(SIEVE_BLOCK * sizeof(long));
+
+    #pragma omp for schedule(dynamic, 1)
+    for (int b = 0; b < blocks; b++) {
+        long low = (long) b * SIEVE_BLOCK + 1;
+        long high = low + SIEVE_BLOCK - 1 < n ? low + SIEVE_BLOCK - 1 : n;
+
+        sieveBlock(sums, low, high);
+        for (long m = low; m <= high; m++) {
+            numbers[m - 1] = saturate(sums[m - low]);
+        }
+    }
+
+    free(sums);
+}
+
+// sums[m - low] = sum of proper divisors of m for m in [low, high],
+// 0 for m = 1, which has none
+void sieveBlock(long* sums, long low, long high) {
+    for (long m = low; m <= high; m++) {
+        sums[m - low] = 1;
+    }
+    if (low == 1) {
+        sums[0] = 0;
+    }
+    for (long d = 2; d * d <= high; d++) {
+        long k = (low + d - 1) / d;
+        if (k <= d) {
+            k = d;
+            sums[d * d - low] += d;
+            k++;
+        }
+        for (long m = d * k; m <= high; m += d, k++) {
+            sums[m - low] += d + k;
+        }
+    }
+}
+
+// Sieve and check in one pass: every pair is checked from its larger number m,
+// whose partner s(m) < m lies in the same or an earlier block. Same-block
+// partners are read from the block buffer while it is in cache, partners in
+// finished blocks from numbers. Only partners in blocks another thread is
+// still sieving are put on a per-thread side list, which is checked after
+// the barrier, so there is no second loop over numbers.
+long getFusedAmicableSum(int n, int pin) {
+    int* numbers = malloc((long) n * sizeof(int));
+    int blocks = ((long) n + SIEVE_BLOCK - 1) / SIEVE_BLOCK;
+    char* finished = calloc(blocks, 1);
+    // s(partner) = m > partner, so partners that are not abundant are
+    // rejected from this n / 8 byte bitmap without touching numbers;
+    // SIEVE_BLOCK is a multiple of 8, so no byte is shared between blocks
+    unsigned char* abundant = calloc(n / 8 + 1, 1);
+    long sum = 0;
+
+    #pragma omp parallel reduction(+: sum)
+    {
+        if (pin) {
+            pinThread(omp_get_thread_num());
+        }
+        long* sums = malloc(SIEVE_BLOCK * sizeof(long));
+        int* candidates = malloc(SIEVE_BLOCK * sizeof(int));
+        // (m, partner) pairs
+        int* deferred = NULL;
+        int deferredCount = 0;
+        int deferredCapacity = 0;
+
+        #pragma omp for schedule(dynamic, 1) nowait
+        for (int b = 0; b < blocks; b++) {
+            long low = (long) b * SIEVE_BLOCK + 1;
+            long high = low + SIEVE_BLOCK - 1 < n ? low + SIEVE_BLOCK - 1 : n;
+
+            sieveBlock(sums, low, high);
+
+            // m is a candidate when its partner is smaller and not in this block
+            int candidateCount = 0;
+            for (long m = low; m <= high; m++) {
+                long partner = sums[m - low];
+                numbers[m - 1] = saturate(partner);
+                if (partner > m) {
+                    abundant[(m - 1) / 8] |= 1 << ((m - 1) % 8);
+                } else if (partner >= low) {
+                    if (partner < m && sums[partner - low] == m) {
+                        sum += m + partner;
+                    }
+                } else if (partner >= 2) {
+                    candidates[candidateCount++] = m;
+                }
+            }
+
+            // the lookups are independent, so prefetching keeps several
+            // cache misses in flight instead of one per mispredicted branch
+            int abundantCount = 0;
+            for (int i = 0; i < candidateCount; i++) {
+                if (i + FUSED_PREFETCH < candidateCount) {
+                    long ahead = sums[candidates[i + FUSED_PREFETCH] - low];
+                    __builtin_prefetch(&abundant[(ahead - 1) / 8]);
+                }
+                long m = candidates[i];
+                long partner = sums[m - low];
+                char done;
+                #pragma omp atomic read seq_cst
+                done = finished[(partner - 1) / SIEVE_BLOCK];
+                if (!done) {
+                    if (deferredCount == deferredCapacity) {
+                        deferredCapacity = deferredCapacity ? 2 * deferredCapacity : 1024;
+                        deferred = realloc(deferred, 2 * deferredCapacity * sizeof(int));
+                    }
+                    deferred[2 * deferredCount] = m;
+                    deferred[2 * deferredCount + 1] = partner;
+                    deferredCount++;
+                    continue;
+                }
+                candidates[abundantCount] = m;
+                abundantCount += abundant[(partner - 1) / 8] >> ((partner - 1) % 8) & 1;
+            }
+            for (int i = 0; i < abundantCount; i++) {
+                if (i + FUSED_PREFETCH < abundantCount) {
+                    __builtin_prefetch(&numbers[sums[candidates[i + FUSED_PREFETCH] - low] - 1]);
+                }
+                long m = candidates[i];
+                long partner = sums[m - low];
+                if (numbers[partner - 1] == m) {
+                    sum += m + partner;
+                }
+            }
+
+            #pragma omp atomic write seq_cst
+            finished[b] = 1;
+        }
+
+        #pragma omp barrier
+        for (int i = 0; i < deferredCount; i++) {
+            int m = deferred[2 * i];
+            int partner = deferred[2 * i + 1];
+            if (numbers[partner - 1] == m) {
+                sum += m + partner;
+            }
+        }
+
+        free(deferred);
+        free(candidates);
+        free(sums);
+    }
+
+    free(abundant);
+    free(finished);
+    free(numbers);
+    return sum;
+}
+
+// sums above INT_MAX are larger than any n the numbers array can hold,
+// so clamping them keeps the divisorSum <= n check exact
+int saturate(long sum) {
+    return sum < INT_MAX ? (int) sum : INT_MAX;
+}
+
+// Segmented sieve: threads take SEGMENT_SIZE sized segments of [1, n] and
+// compute sigma for a whole segment from the primes up to sqrt(n), so only
+// the prime table and one segment per thread are ever in memory. Every
+// number m whose partner s(m) = sigma(m) - m is larger (and at most n) is
+// checked right away, from the segment when the partner is in it, and
+// otherwise by factorising the partner with the divisor table, which
+// mostly stops after a few primes since sigma(partner) must equal sigma(m).
+// All sums are 64-bit. With beyond, partners above n are factorised as
+// well, so pairs whose smaller number is in [1, n] are all counted.
+long getSegmentedAmicableSum(long n, int pin, int beyond) {
+    long segmentSize = SEGMENT_SIZE;
+    while (segmentSize * segmentSize < n) {
+        segmentSize *= 2;
+    }
+    int primeCount;
+    int* primes = getPrimes((int) sqrt((double) n) + 1, &primeCount);
+    int divisorCount;
+    struct divisor* divisors = getDivisors(beyond ? PARTNER_LIMIT * n : n, &divisorCount);
+    long segments = (n + segmentSize - 1) / segmentSize;
+    long sum = 0;
+
+    #pragma omp parallel reduction(+: sum)
+    {
+        if (pin) {
+            pinThread(omp_get_thread_num());
+        }
+        long* sigma = malloc(segmentSize * sizeof(long));
+        long* factored = malloc(segmentSize * sizeof(long));
+        int* marks = malloc(segmentSize * sizeof(int));
 
-            if (i != n / i) {
-                sum += n / i;
+        #pragma omp for schedule(dynamic, 1)
+        for (long segment = 0; segment < segments; segment++) {
+            long low = segment * segmentSize + 1;
+            long high = low + segmentSize - 1 < n ? low + segmentSize - 1 : n;
+            sieveSegment(low, high, primes, primeCount, sigma, factored, marks);
+
+            for (long m = low; m <= high; m++) {
+                long partner = sigma[m - low] - m;
+                if (partner <= m || (partner > n && !beyond)) {
+                    continue;
+                }
+                // amicable numbers share sigma(m) = sigma(partner) = m + partner
+                int amicable = partner <= high
+                    ? sigma[partner - low] == sigma[m - low]
+                    : hasSigma(partner, sigma[m - low], divisors, divisorCount);
+                if (amicable) {
+                    sum += m + partner;
+                }
             }
         }
+
+        free(marks);
+        free(factored);
+        free(sigma);
     }
 
+    free(divisors);
+    free(primes);
     return sum;
 }
 
+// sigma[m - low] = sum of all divisors of m for m in [low, high], factored
+// and marks are scratch space; primes must reach sqrt(high). Powers of
+// each prime are visited from the largest down, so the first power that
+// reaches m is its exact one and no division is needed.
+void sieveSegment(long low, long high, int* primes, int primeCount, long* sigma, long* factored, int* marks) {
+    for (long m = low; m <= high; m++) {
+        sigma[m - low] = 1;
+        factored[m - low] = 1;
+        marks[m - low] = 0;
+    }
+
+    for (int i = 0; i < primeCount && (long) primes[i] * primes[i] <= high; i++) {
+        int p = primes[i];
+        long power = p;
+        while (power <= high / p) {
+            power *= p;
+        }
+        for (; power > 1; power /= p) {
+            // 1 + p + ... + power
+            long powerSum = (power * p - 1) / (p - 1);
+            for (long m = (low + power - 1) / power * power; m <= high; m += power) {
+                if (marks[m - low] != p) {
+                    marks[m - low] = p;
+                    sigma[m - low] *= powerSum;
+                    factored[m - low] *= power;
+                }
+            }
+        }
+    }
+
+    // what is left is 1 or a single prime above sqrt(high)
+    for (long m = low; m <= high; m++) {
+        if (factored[m - low] != m) {
+            sigma[m - low] *= m / factored[m - low] + 1;
+        }
+    }
+}
+
+// whether sigma(n) == target, by factorising n like getDivisorSum; past
+// the end of the divisor table odd numbers are tried with plain division.
+// Each prime power sum must divide what is left of target, and once no
+// prime up to p divides the cofactor, its sigma is below
+// cofactor * (1 + 1 / p)^(number of its prime factors), so most numbers
+// are rejected long before sqrt(n).
+int hasSigma(long n, long target, struct divisor* divisors, int divisorCount) {
+    int twos = __builtin_ctzl(n);
+    unsigned long m = (unsigned long) n >> twos;
+    long powerSum = (2L << twos) - 1;
+    if (target % powerSum != 0) {
+        return 0;
+    }
+    target /= powerSum;
+
+    for (int i = 0; i < divisorCount && divisors[i].prime * divisors[i].prime <= m; i++) {
+        powerSum = takePower(&m, &divisors[i]);
+        if (target % powerSum != 0) {
+            return 0;
+        }
+        target /= powerSum;
+
+        if (m > 1 && (unsigned long) target <= m) {
+            return 0;
+        }
+        if (i % 16 == 15 && m > 1) {
+            double factors = floor(log((double) m) / log((double) divisors[i].prime + 1));
+            if (target > m * pow(1 + 1.0 / divisors[i].prime, factors) * (1 + 1e-9)) {
+                return 0;
+            }
+        }
+    }
+    for (unsigned long p = divisorCount > 0 ? divisors[divisorCount - 1].prime + 2 : 3; p * p <= m; p += 2) {
+        if (m % p == 0) {
+            long power = 1;
+            powerSum = 1;
+            do {
+                m /= p;
+                power *= p;
+                powerSum += power;
+            } while (m % p == 0);
+            if (target % powerSum != 0) {
+                return 0;
+            }
+            target /= powerSum;
+        }
+    }
+    return m > 1 ? (unsigned long) target == m + 1 : target == 1;
+}
+
+// primes up to limit with the sieve of Eratosthenes
+int* getPrimes(int limit, int* count) {
+    char* composite = calloc(limit + 1, 1);
+    int* primes = malloc((limit / 2 + 2) * sizeof(int));
+    *count = 0;
+    for (long i = 2; i <= limit; i++) {
+        if (!composite[i]) {
+            primes[(*count)++] = i;
+            for (long j = i * i; j <= limit; j += i) {
+                composite[j] = 1;
+            }
+        }
+    }
+    free(composite);
+    return primes;
+}
+
+void pinThread(int index) {
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        return;
+    }
+
+    int target = index % CPU_COUNT(&allowed);
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &allowed) && target-- == 0) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(cpu, &set);
+            sched_setaffinity(0, sizeof(set), &set);
+            return;
+        }
+    }
+}
+
+// Sum of proper divisors by factorising n with the odd primes up to sqrt(n).
+// Powers of two are taken off with one shift, every other divisibility test
+// and quotient is a single multiplication with the precomputed inverse, and
+// the loop stops as soon as the remaining cofactor has no divisor left.
+long getDivisorSum(long n, struct divisor* divisors, int divisorCount) {
+    int twos = __builtin_ctzl(n);
+    unsigned long m = (unsigned long) n >> twos;
+    long sigma = (2L << twos) - 1;
+
+    for (int i = 0; i < divisorCount && divisors[i].prime * divisors[i].prime <= m; i++) {
+        sigma *= takePower(&m, &divisors[i]);
+    }
+    if (m > 1) {
+        sigma *= m + 1;
+    }
+
+    return sigma - n;
+}
+
+// divides the whole power of d->prime out of *m and returns its divisor
+// sum 1 + p + ... + p^k, which is 1 when d->prime does not divide *m
+long takePower(unsigned long* m, struct divisor* d) {
+    long power = 1;
+    long powerSum = 1;
+    unsigned long quotient = *m * d->inverse;
+    while (quotient <= d->limit) {
+        *m = quotient;
+        power *= d->prime;
+        powerSum += power;
+        quotient = *m * d->inverse;
+    }
+    return powerSum;
+}
+
+// the odd primes up to sqrt(limit), enough to factorise any n <= limit
+struct divisor* getDivisors(long limit, int* count) {
+    int primeCount;
+    int* primes = getPrimes((int) sqrt((double) limit) + 1, &primeCount);
+    struct divisor* divisors = malloc((primeCount + 1) * sizeof(struct divisor));
+    *count = 0;
+    for (int i = 0; i < primeCount; i++) {
+        if (primes[i] == 2) {
+            continue;
+        }
+        // Newton iteration, each step doubles the number of correct low bits
+        unsigned long p = primes[i];
+        unsigned long inverse = p;
+        for (int bits = 3; bits < 64; bits *= 2) {
+            inverse *= 2 - p * inverse;
+        }
+        divisors[*count].prime = p;
+        divisors[*count].inverse = inverse;
+        divisors[*count].limit = ~0UL / p;
+        (*count)++;
+    }
+    free(primes);
+    return divisors;
+}
+
 /* 
 
 Meritve: